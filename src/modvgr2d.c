@@ -20,8 +20,11 @@ limitations under the License.
 #else
 #define printf(...)
 #endif
+#include <string.h>
 
 #include "py/runtime.h"
+#include "py/binary.h"
+#include "py/stream.h"
 
 #include "vgr2dlib.h"
 
@@ -31,17 +34,6 @@ limitations under the License.
 #define MFREE(ptr, sz) m_free(ptr)
 #endif
 
-#define MAX_RUNS 128
-
-#define MAX_DX 0x1fff // 9.4
-#define MAX_NLX 0x1fff // 9.4
-#define MAX_SPANX 0x1fff // 9.4
-#define MAX_CLRX 0xff // 4.4
-#define MIN_DX 0x10
-
-// 4 dx + 4 span
-#define MAX_PACKED_SIZE 16
-
 extern uint8_t fpga_graphics_dev();
 extern void fpga_write_internal(uint8_t *buf, unsigned int len, bool hold);
 
@@ -53,16 +45,30 @@ void *vgr2d_alloc(size_t size, int n) {
   return m_malloc(size * n);
 }
 
+void vgr2d_free(void *ptr, size_t size, int n) {
+  MFREE(ptr, size * n);
+}
+
 
 //////////////////////////////////////// Shared
 
 static transform_t *get_transform(mp_obj_t obj);
+static uint16_t *get_busy(mp_obj_t obj);
+
+// The iterators of a Renderer read the points, samples and edge tables of
+// its objects between steps, so they must not change until it is done
+static void check_idle(mp_obj_t obj) {
+  uint16_t *busy = get_busy(obj);
+  if (busy != NULL && *busy > 0)
+    mp_raise_ValueError(MP_ERROR_TEXT("Object is being rendered"));
+}
 
 static void transform_print(const mp_print_t *print, transform_t *tr) {
   mp_printf(print, "(%d,%d)", (int)(tr->tx/XSCALE), (int)(tr->ty/YSCALE));
 }
 
 static mp_obj_t set_position(mp_obj_t obj, mp_obj_t x_obj, mp_obj_t y_obj) {
+  check_idle(obj);
   transform_t *tr = get_transform(obj);
   if (tr != NULL) {
     int x = mp_obj_get_int(x_obj);
@@ -75,11 +81,354 @@ static mp_obj_t set_position(mp_obj_t obj, mp_obj_t x_obj, mp_obj_t y_obj) {
 
 static MP_DEFINE_CONST_FUN_OBJ_3(set_position_obj, set_position);
 
+// Points are either a list of (x,y) tuples or any buffer of interleaved
+// int16 x,y such as array('h'), bytearray or memoryview. Buffers are read
+// directly without going through the interpreter per vertex.
+
+// int16 data comes as array('h') or as raw bytes, buffers of any other
+// element type would be misread
+static void check_int16_buffer(mp_buffer_info_t *bufinfo) {
+  int tc = bufinfo->typecode;
+  if (tc != 'h' && tc != 'B' && tc != BYTEARRAY_TYPECODE)
+    mp_raise_TypeError(MP_ERROR_TEXT("Buffer must be array('h'), bytes, bytearray or memoryview"));
+}
+
+static bool get_points_buffer(mp_obj_t obj, mp_buffer_info_t *bufinfo) {
+  if (mp_obj_is_type(obj, &mp_type_list) || !mp_get_buffer(obj, bufinfo, MP_BUFFER_READ))
+    return false;
+  check_int16_buffer(bufinfo);
+  if (bufinfo->len & 3)
+    mp_raise_ValueError(MP_ERROR_TEXT("Point buffer must hold int16 x,y pairs"));
+  return true;
+}
+
+// Converts the points into pts from index j, returns the index after them.
+// With pts NULL the points are only checked, so a caller can raise any
+// error before it changes the shape.
+static int load_points(mp_obj_t obj, uint16_t *pts, int j) {
+  mp_buffer_info_t bufinfo;
+  if (get_points_buffer(obj, &bufinfo)) {
+    if (pts == NULL)
+      return j + (bufinfo.len >> 1);
+    const uint8_t *src = (const uint8_t *)bufinfo.buf;
+    int16_t xy[2];
+    for (size_t i = 0; i < bufinfo.len; i += 4, j += 2) {
+      memcpy(xy, src+i, 4); // buffer may not be aligned
+      pts[j] = XFX(xy[0]);
+      pts[j+1] = YFX(xy[1]);
+    }
+    return j;
+  }
+
+  size_t list_len = 0;
+  mp_obj_t *list = NULL;
+  mp_obj_list_get(obj, &list_len, &list);
+  for (size_t i = 0; i < list_len; i++, j+=2) {
+    size_t tpl_len;
+    mp_obj_t *tpl;
+    mp_obj_tuple_get(list[i], &tpl_len, &tpl);
+    if (tpl_len==2) {
+      int x = mp_obj_get_int(tpl[0]);
+      int y = mp_obj_get_int(tpl[1]);
+      if (pts != NULL) {
+	pts[j] = XFX(x);
+	pts[j+1] = YFX(y);
+      }
+    } else {
+      mp_raise_ValueError(MP_ERROR_TEXT("List element is not a pair"));
+    }
+  }
+  return j;
+}
+
+// Point storage is only reallocated when it has to grow, so shapes can be
+// updated every frame without allocating. Both arrays are allocated before
+// either old one is freed, so a failed allocation leaves the shape as it
+// was. The caller commits n_pts once the points are loaded.
+static void reserve_points(polygon_t *poly, int n_pts, int n_ends) {
+  uint16_t *pts = (n_pts > poly->max_pts) ? m_new(uint16_t, n_pts) : NULL;
+  uint16_t *ends = (n_ends > poly->max_contours) ? m_new(uint16_t, n_ends) : NULL;
+  if (pts != NULL) {
+    if (poly->pts != NULL)
+      MFREE(poly->pts, poly->max_pts * sizeof(uint16_t));
+    poly->pts = pts;
+    poly->max_pts = n_pts;
+  }
+  if (ends != NULL) {
+    if (poly->ends != NULL)
+      MFREE(poly->ends, poly->max_contours * sizeof(uint16_t));
+    poly->ends = ends;
+    poly->max_contours = n_ends;
+  }
+}
+
+// Closed contours: a point list/buffer, or a list of them
+static void load_polygon(polygon_t *poly, mp_obj_t obj) {
+  // a list of point lists or buffers is one contour per element,
+  // otherwise a single contour
+  size_t n_contours = 1;
+  mp_obj_t *contours = &obj;
+  mp_buffer_info_t bufinfo;
+  if (!get_points_buffer(obj, &bufinfo)) {
+    size_t list_len = 0;
+    mp_obj_t *list = NULL;
+    mp_obj_list_get(obj, &list_len, &list);
+    if (list_len > 0 && !mp_obj_is_type(list[0], &mp_type_tuple)) {
+      n_contours = list_len;
+      contours = list;
+    }
+  }
+
+  // errors are raised before the shape is touched
+  int n_pts = 0;
+  for (size_t k = 0; k < n_contours; k++)
+    n_pts = load_points(contours[k], NULL, n_pts) + 2;
+  reserve_points(poly, n_pts, (n_contours > 1) ? n_contours : 0);
+
+  int j = 0;
+  for (size_t k = 0; k < n_contours; k++) {
+    int first = j;
+    j = load_points(contours[k], poly->pts, j);
+    // close the contour
+    if (j > first) {
+      poly->pts[j++] = poly->pts[first];
+      poly->pts[j++] = poly->pts[first+1];
+    }
+    if (n_contours > 1)
+      poly->ends[k] = j;
+  }
+  poly->n_pts = j;
+  poly->n_contours = n_contours;
+  simplify_polygon(poly);
+  polygon_changed(poly);
+}
+
+// Open path: a point list/buffer
+static void load_polyline(polygon_t *poly, mp_obj_t obj) {
+  reserve_points(poly, load_points(obj, NULL, 0), 0);
+  poly->n_pts = load_points(obj, poly->pts, 0);
+  poly->n_contours = 1;
+  simplify_polygon(poly);
+  polygon_changed(poly);
+}
+
+static rectangle_t *get_rectangle(mp_obj_t obj);
+static polygon_t *get_polygon(mp_obj_t obj, bool *closed);
+static instance_t *get_instance(mp_obj_t obj);
+static trace_t *get_trace(mp_obj_t obj);
+static path_t *get_path(mp_obj_t obj);
+
+static mp_obj_t set_points(mp_obj_t obj, mp_obj_t pts_obj) {
+  check_idle(obj);
+  bool closed;
+  polygon_t *poly = get_polygon(obj, &closed);
+  if (poly != NULL) {
+    if (closed)
+      load_polygon(poly, pts_obj);
+    else
+      load_polyline(poly, pts_obj);
+  }
+  return obj;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(set_points_obj, set_points);
+
+static mp_obj_t set_point(size_t n_args, const mp_obj_t *args) {
+  check_idle(args[0]);
+  bool closed;
+  polygon_t *poly = get_polygon(args[0], &closed);
+  if (poly != NULL) {
+    int i = 2*mp_obj_get_int(args[1]);
+    int start = 0;
+    for (int k = 0; k < poly->n_contours; k++) {
+      int end = (poly->n_contours > 1) ? poly->ends[k] : poly->n_pts;
+      // closed contours repeat their first vertex at the end, an empty
+      // one has none
+      int n = (closed && end > start) ? (end-start-2) : (end-start);
+      if (i >= 0 && i < n) {
+	uint16_t x = XFX(mp_obj_get_int(args[2]));
+	uint16_t y = YFX(mp_obj_get_int(args[3]));
+	poly->pts[start+i] = x;
+	poly->pts[start+i+1] = y;
+	if (closed && i == 0) {
+	  poly->pts[end-2] = x;
+	  poly->pts[end-1] = y;
+	}
+	polygon_changed(poly);
+	return args[0];
+      }
+      i -= n;
+      start = end;
+    }
+    mp_raise_msg(&mp_type_IndexError, MP_ERROR_TEXT("Point index out of range"));
+  }
+  return args[0];
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(set_point_obj, 4, 4, set_point);
+
+// tol= in pixels, fractions are kept when floats are available. Points
+// closer than this to the outline are dropped whenever points are loaded,
+// so set_point indexes the points that were kept.
+static uint16_t get_tolerance(mp_obj_t obj) {
+  if (obj == mp_const_none)
+    return 0;
+#if MICROPY_PY_BUILTINS_FLOAT
+  if (mp_obj_is_float(obj)) {
+    mp_float_t t = mp_obj_get_float(obj);
+    if (t < 0 || t > XFX_INT(0xffff))
+      mp_raise_ValueError(MP_ERROR_TEXT("Tolerance out of range"));
+    return (uint16_t)(t*XSCALE + 0.5);
+  }
+#endif
+  int t = mp_obj_get_int(obj);
+  if (t < 0 || t > XFX_INT(0xffff))
+    mp_raise_ValueError(MP_ERROR_TEXT("Tolerance out of range"));
+  return XFX(t);
+}
+
+// dropped() is the number of points the tolerance removed on the last load
+static mp_obj_t dropped(mp_obj_t obj) {
+  polygon_t *poly = get_polygon(obj, NULL);
+  return mp_obj_new_int((poly != NULL) ? poly->dropped : 0);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(dropped_obj, dropped);
+
+// set_color(color) sets the color the shape is drawn with, the interior
+// of an outlined polygon, set_color(fill, stroke) sets both
+static mp_obj_t set_color(size_t n_args, const mp_obj_t *args) {
+  check_idle(args[0]);
+  rectangle_t *rect = get_rectangle(args[0]);
+  polygon_t *poly = get_polygon(args[0], NULL);
+  instance_t *inst = get_instance(args[0]);
+  trace_t *trace = get_trace(args[0]);
+  path_t *path = get_path(args[0]);
+  uint8_t c = mp_obj_get_int(args[1]);
+  if (rect != NULL) {
+    rect->fclr = c;
+  } else if (trace != NULL) {
+    trace->clr = c;
+  } else if (path != NULL) {
+    path->fclr = c;
+  } else if (inst != NULL) {
+    inst->clr = c;
+    inst->recolor = true;
+  } else if (poly != NULL) {
+    if (n_args >= 3) {
+      poly->fclr = c;
+      poly->sclr = mp_obj_get_int(args[2]);
+    } else if (poly->fill)
+      poly->fclr = c;
+    else
+      poly->sclr = c;
+  }
+  return args[0];
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(set_color_obj, 2, 3, set_color);
+
+static mp_obj_t set_width(mp_obj_t obj, mp_obj_t w_obj) {
+  check_idle(obj);
+  polygon_t *poly = get_polygon(obj, NULL);
+  trace_t *trace = get_trace(obj);
+  int w = mp_obj_get_int(w_obj);
+  if (w < 1)
+    mp_raise_ValueError(MP_ERROR_TEXT("Stoke width must be at least 1"));
+  if (poly != NULL) {
+    poly->width = w;
+    polygon_changed(poly);
+  } else if (trace != NULL) {
+    trace->width = w;
+    trace_changed(trace);
+  }
+  return obj;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(set_width_obj, set_width);
+
+// Dash lengths are in pixels along the stroke starting with a dash, an odd
+// list repeats once so dashes and gaps alternate, None or [] is solid
+static void load_dash(polygon_t *poly, mp_obj_t obj) {
+  size_t len = 0;
+  mp_obj_t *items = NULL;
+  if (obj != mp_const_none)
+    mp_obj_get_array(obj, &len, &items);
+  int n = (len & 1) ? 2*len : len;
+  int total = 0;
+  for (size_t i = 0; i < len; i++) {
+    int v = mp_obj_get_int(items[i]);
+    if (v < 0 || v > XFX_INT(0xffff))
+      mp_raise_ValueError(MP_ERROR_TEXT("Dash length out of range"));
+    total += v;
+  }
+  if (len > 0 && total == 0)
+    mp_raise_ValueError(MP_ERROR_TEXT("Dash pattern must have a length"));
+  if (n > poly->max_dash) {
+    poly->dash = m_renew(uint16_t, poly->dash, poly->max_dash, n);
+    poly->max_dash = n;
+  }
+  for (int i = 0; i < n; i++)
+    poly->dash[i] = XFX(mp_obj_get_int(items[i % len]));
+  poly->n_dash = n;
+  polygon_changed(poly);
+}
+
+static mp_obj_t set_dash(mp_obj_t obj, mp_obj_t dash_obj) {
+  check_idle(obj);
+  polygon_t *poly = get_polygon(obj, NULL);
+  if (poly != NULL)
+    load_dash(poly, dash_obj);
+  return obj;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(set_dash_obj, set_dash);
+
+// dash= keyword of the Line and Polyline constructors, and tol= for
+// Polyline, parsed before the points are loaded
+static void parse_stroke_args(polygon_t *poly, size_t n_args, size_t n_kw, const mp_obj_t *args, bool with_tol) {
+  mp_map_t kwargs;
+  mp_map_init_fixed_table(&kwargs, n_kw, args + n_args);
+
+  static const mp_arg_t allowed_args[] = {
+    { MP_QSTR_dash, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_tol, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+  };
+
+  mp_arg_val_t parsed_args[MP_ARRAY_SIZE(allowed_args)];
+  mp_arg_parse_all(0, args, &kwargs, with_tol ? 2 : 1, allowed_args, parsed_args);
+  load_dash(poly, parsed_args[0].u_obj);
+  if (with_tol)
+    poly->tol = get_tolerance(parsed_args[1].u_obj);
+}
+
+static void dash_print(const mp_print_t *print, polygon_t *poly) {
+  if (poly->n_dash > 0) {
+    mp_printf(print, ",dash=[");
+    for (int i = 0; i < poly->n_dash; i++)
+      mp_printf(print, (i > 0) ? ",%d" : "%d", XFX_INT(poly->dash[i]));
+    mp_printf(print, "]");
+  }
+}
+
+static mp_obj_t set_size(mp_obj_t obj, mp_obj_t w_obj, mp_obj_t h_obj) {
+  check_idle(obj);
+  rectangle_t *rect = get_rectangle(obj);
+  if (rect != NULL) {
+    rect->w = mp_obj_get_int(w_obj);
+    rect->h = mp_obj_get_int(h_obj);
+  }
+  return obj;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_3(set_size_obj, set_size);
+
 
 //////////////////////////////////////// Rect
 
 typedef struct rect_obj_s {
   mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
   rectangle_t rect;
 } rect_obj_t;
 
@@ -88,6 +437,7 @@ static mp_obj_t rect_make_new(const mp_obj_type_t *type, size_t n_args, size_t n
 
   rect_obj_t *self = m_new_obj(rect_obj_t);
   self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
 
   init_transform(&(self->rect.tr));
 
@@ -110,6 +460,8 @@ static void rect_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_
 
 static const mp_rom_map_elem_t rect_locals_dict_table[] = {
   { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_size), MP_ROM_PTR(&set_size_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
 };
 
 static MP_DEFINE_CONST_DICT(rect_locals_dict, rect_locals_dict_table);
@@ -124,10 +476,122 @@ MP_DEFINE_CONST_OBJ_TYPE(
 );
 
 
+//////////////////////////////////////// RectBatch
+
+typedef struct rect_batch_obj_s {
+  mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
+  rect_batch_t batch;
+} rect_batch_obj_t;
+
+// Values are converted and checked before the rect is changed
+static void rect_batch_store(rect_batch_t *batch, int i, const mp_obj_t *vals) {
+  int x = mp_obj_get_int(vals[0]);
+  uint16_t y = YFX(mp_obj_get_int(vals[1]));
+  int w = mp_obj_get_int(vals[2]);
+  int h = mp_obj_get_int(vals[3]);
+  uint8_t clr = mp_obj_get_int(vals[4]);
+  if (w < 0 || h < 0)
+    mp_raise_ValueError(MP_ERROR_TEXT("Rect size must not be negative"));
+  if (y != batch->y[i])
+    batch->sorted = false;
+  batch->x[i] = XFX(x);
+  batch->y[i] = y;
+  batch->w[i] = w;
+  batch->h[i] = h;
+  batch->clr[i] = clr;
+}
+
+// RectBatch(n) or RectBatch([(x,y,w,h,color), ...]), up to 65535 rects
+static mp_obj_t rect_batch_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 1, 1, false);
+
+  rect_batch_obj_t *self = m_new_obj(rect_batch_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
+
+  init_transform(&(self->batch.tr));
+
+  size_t list_len = 0;
+  mp_obj_t *list = NULL;
+  if (mp_obj_is_int(args[0])) {
+    mp_int_t n = mp_obj_get_int(args[0]);
+    if (n < 0)
+      mp_raise_ValueError(MP_ERROR_TEXT("Rect count must not be negative"));
+    list_len = n;
+  } else {
+    mp_obj_list_get(args[0], &list_len, &list);
+  }
+  // rects are indexed by uint16_t in the sort order
+  if (list_len > UINT16_MAX)
+    mp_raise_ValueError(MP_ERROR_TEXT("Too many rects in a batch"));
+
+  rect_batch_t *batch = &(self->batch);
+  batch->n = list_len;
+  batch->x = m_new(uint16_t, list_len);
+  batch->y = m_new(uint16_t, list_len);
+  batch->w = m_new(uint16_t, list_len);
+  batch->h = m_new(uint16_t, list_len);
+  batch->clr = m_new(uint8_t, list_len);
+  batch->order = m_new(uint16_t, list_len);
+  for (size_t i = 0; i < list_len; i++) {
+    batch->order[i] = i;
+    batch->x[i] = batch->y[i] = batch->w[i] = batch->h[i] = 0;
+    batch->clr[i] = 0;
+    if (list != NULL) {
+      mp_obj_t *vals;
+      mp_obj_get_array_fixed_n(list[i], 5, &vals);
+      rect_batch_store(batch, i, vals);
+    }
+  }
+  batch->sorted = false;
+
+  return MP_OBJ_FROM_PTR(self);
+}
+
+static void rect_batch_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
+
+  rect_batch_obj_t * self = (rect_batch_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "RectBatch(%d)@", self->batch.n);
+  transform_print(print, &(self->batch.tr));
+}
+
+// set(i, x, y, w, h, color)
+static mp_obj_t rect_batch_set(size_t n_args, const mp_obj_t *args) {
+  check_idle(args[0]);
+  rect_batch_obj_t * self = (rect_batch_obj_t *)MP_OBJ_TO_PTR(args[0]);
+  int i = mp_obj_get_int(args[1]);
+  if (i < 0 || i >= self->batch.n)
+    mp_raise_msg(&mp_type_IndexError, MP_ERROR_TEXT("Rect index out of range"));
+  rect_batch_store(&(self->batch), i, &args[2]);
+  return args[0];
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(rect_batch_set_obj, 7, 7, rect_batch_set);
+
+static const mp_rom_map_elem_t rect_batch_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set), MP_ROM_PTR(&rect_batch_set_obj) },
+};
+
+static MP_DEFINE_CONST_DICT(rect_batch_locals_dict, rect_batch_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    rect_batch_type,
+    MP_QSTR_RectBatch,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)rect_batch_make_new,
+    print, (const void *)rect_batch_print,
+    locals_dict, &rect_batch_locals_dict
+);
+
+
 //////////////////////////////////////// Polygon
 
 typedef struct polygon_obj_s {
   mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
   polygon_t poly;
 } polygon_obj_t;
 
@@ -136,8 +600,9 @@ static mp_obj_t polygon_make_new(const mp_obj_type_t *type, size_t n_args, size_
 
   polygon_obj_t *self = m_new_obj(polygon_obj_t);
   self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
 
-  init_transform(&(self->poly.tr));
+  init_polygon(&(self->poly));
 
   mp_map_t kwargs;
   mp_map_init_fixed_table(&kwargs, n_kw, args + n_args);
@@ -146,47 +611,42 @@ static mp_obj_t polygon_make_new(const mp_obj_type_t *type, size_t n_args, size_
     { MP_QSTR_fill, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
     { MP_QSTR_stroke, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
     { MP_QSTR_width, MP_ARG_INT, {.u_int = 3} },
+    { MP_QSTR_rule, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_tol, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
   };
 
   mp_arg_val_t parsed_args[MP_ARRAY_SIZE(allowed_args)];
   mp_arg_parse_all(0, args, &kwargs, MP_ARRAY_SIZE(allowed_args), allowed_args, parsed_args);
 
+  // with both the border is drawn over the interior
   self->poly.fill = false;
   self->poly.stroke = false;
   if (mp_obj_is_int(parsed_args[0].u_obj)) {
     self->poly.fclr = mp_obj_get_int(parsed_args[0].u_obj);
     self->poly.fill = true;
-  } else if (mp_obj_is_int(parsed_args[1].u_obj)) {
+  }
+  if (mp_obj_is_int(parsed_args[1].u_obj)) {
     self->poly.sclr = mp_obj_get_int(parsed_args[1].u_obj);
     self->poly.stroke = true;
-  } else {
+  }
+  if (!self->poly.fill && !self->poly.stroke) {
     mp_raise_ValueError(MP_ERROR_TEXT("Must provide at least one of the fill or stroke arguments."));
   }
   self->poly.width = parsed_args[2].u_int;
   if (self->poly.width < 1)
     mp_raise_ValueError(MP_ERROR_TEXT("Stoke width must be at least 1"));
 
-  size_t list_len = 0;
-  mp_obj_t *list = NULL;
-  mp_obj_list_get(args[0], &list_len, &list);
-
-  self->poly.n_pts = 2*list_len+2;
-  self->poly.pts = m_new(uint16_t, self->poly.n_pts);
-
-  int i, j;
-  for (i = 0, j = 0; i < list_len; i++, j+=2) {
-    size_t tpl_len;
-    mp_obj_t *tpl;
-    mp_obj_tuple_get(list[i], &tpl_len, &tpl);
-    if (tpl_len==2) {
-      self->poly.pts[j] = XFX(mp_obj_get_int(tpl[0]));
-      self->poly.pts[j+1] = YFX(mp_obj_get_int(tpl[1]));
-    } else {
-      mp_raise_ValueError(MP_ERROR_TEXT("List element is not a pair"));
-    }
+  self->poly.rule = RULE_EVENODD;
+  if (parsed_args[3].u_obj != mp_const_none) {
+    qstr rule = mp_obj_str_get_qstr(parsed_args[3].u_obj);
+    if (rule == MP_QSTR_nonzero)
+      self->poly.rule = RULE_NONZERO;
+    else if (rule != MP_QSTR_evenodd)
+      mp_raise_ValueError(MP_ERROR_TEXT("Fill rule must be 'evenodd' or 'nonzero'"));
   }
-  self->poly.pts[j++] = self->poly.pts[0];
-  self->poly.pts[j++] = self->poly.pts[1];
+  self->poly.tol = get_tolerance(parsed_args[4].u_obj);
+
+  load_polygon(&(self->poly), args[0]);
 
   return MP_OBJ_FROM_PTR(self);
 }
@@ -197,13 +657,31 @@ static void polygon_print(const mp_print_t *print, mp_obj_t self_in, mp_print_ki
   polygon_obj_t * self = (polygon_obj_t *)MP_OBJ_TO_PTR(self_in);
   mp_printf(print, "Polygon([");
 
+  bool multi = (self->poly.n_contours > 1);
+  if (multi)
+    mp_printf(print, "[");
+  int k = 0;
   for (int i = 0; i < self->poly.n_pts; i += 2) {
-    if (i > 0) mp_printf(print, ",");
+    if (multi && i == self->poly.ends[k]) {
+      // one break per contour ending here, empty ones included
+      while (i == self->poly.ends[k]) {
+	mp_printf(print, "],[");
+	k++;
+      }
+    } else if (i > 0)
+      mp_printf(print, ",");
     mp_printf(print, "(%d,%d)", self->poly.pts[i], self->poly.pts[i+1]);
   }
+  // empty contours after the last point
+  for (; multi && k+1 < self->poly.n_contours; k++)
+    mp_printf(print, "],[");
+  if (multi)
+    mp_printf(print, "]");
   mp_printf(print, "]");
   if (self->poly.fill)
     mp_printf(print, ",fill=color%d", self->poly.fclr);
+  if (self->poly.fill && self->poly.rule == RULE_NONZERO)
+    mp_printf(print, ",rule=nonzero");
   if (self->poly.stroke) {
     mp_printf(print, ",stroke=color%d,width=%d", self->poly.sclr, self->poly.width);
   }
@@ -213,6 +691,11 @@ static void polygon_print(const mp_print_t *print, mp_obj_t self_in, mp_print_ki
 
 static const mp_rom_map_elem_t polygon_locals_dict_table[] = {
   { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_points), MP_ROM_PTR(&set_points_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_point), MP_ROM_PTR(&set_point_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_width), MP_ROM_PTR(&set_width_obj) },
+  { MP_ROM_QSTR(MP_QSTR_dropped), MP_ROM_PTR(&dropped_obj) },
 };
 
 static MP_DEFINE_CONST_DICT(polygon_locals_dict, polygon_locals_dict_table);
@@ -231,43 +714,29 @@ MP_DEFINE_CONST_OBJ_TYPE(
 
 typedef struct polyline_obj_s {
   mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
   polygon_t poly;
 } polyline_obj_t;
 
 static mp_obj_t polyline_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
-  mp_arg_check_num(n_args, n_kw, 2, 3, false);
+  mp_arg_check_num(n_args, n_kw, 2, 3, true);
 
   polyline_obj_t *self = m_new_obj(polyline_obj_t);
   self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
 
-  init_transform(&(self->poly.tr));
+  init_polygon(&(self->poly));
 
   self->poly.fill = false;
   self->poly.stroke = true;
+  self->poly.rule = RULE_EVENODD;
   self->poly.sclr = mp_obj_get_int(args[1]);
   self->poly.width = (n_args >= 3) ? mp_obj_get_int(args[2]) : 2;
   if (self->poly.width < 1)
     mp_raise_ValueError(MP_ERROR_TEXT("Stoke width must be at least 1"));
 
-  size_t list_len = 0;
-  mp_obj_t *list = NULL;
-  mp_obj_list_get(args[0], &list_len, &list);
-
-  self->poly.n_pts = 2*list_len;
-  self->poly.pts = m_new(uint16_t, self->poly.n_pts);
-
-  int i, j;
-  for (i = 0, j = 0; i < list_len; i++, j+=2) {
-    size_t tpl_len;
-    mp_obj_t *tpl;
-    mp_obj_tuple_get(list[i], &tpl_len, &tpl);
-    if (tpl_len==2) {
-      self->poly.pts[j] = XFX(mp_obj_get_int(tpl[0]));
-      self->poly.pts[j+1] = YFX(mp_obj_get_int(tpl[1]));
-    } else {
-      mp_raise_ValueError(MP_ERROR_TEXT("List element is not a pair"));
-    }
-  }
+  parse_stroke_args(&(self->poly), n_args, n_kw, args, true);
+  load_polyline(&(self->poly), args[0]);
 
   return MP_OBJ_FROM_PTR(self);
 }
@@ -287,6 +756,7 @@ static void polyline_print(const mp_print_t *print, mp_obj_t self_in, mp_print_k
     mp_printf(print, ",fill=color%d", self->poly.fclr);
   if (self->poly.stroke) {
     mp_printf(print, ",stroke=color%d,width=%d", self->poly.sclr, self->poly.width);
+    dash_print(print, &(self->poly));
   }
   mp_printf(print, ")@");
   transform_print(print, &(self->poly.tr));
@@ -294,6 +764,12 @@ static void polyline_print(const mp_print_t *print, mp_obj_t self_in, mp_print_k
 
 static const mp_rom_map_elem_t polyline_locals_dict_table[] = {
   { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_points), MP_ROM_PTR(&set_points_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_point), MP_ROM_PTR(&set_point_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_width), MP_ROM_PTR(&set_width_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_dash), MP_ROM_PTR(&set_dash_obj) },
+  { MP_ROM_QSTR(MP_QSTR_dropped), MP_ROM_PTR(&dropped_obj) },
 };
 
 static MP_DEFINE_CONST_DICT(polyline_locals_dict, polyline_locals_dict_table);
@@ -312,19 +788,22 @@ MP_DEFINE_CONST_OBJ_TYPE(
 
 typedef struct line_obj_s {
   mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
   polygon_t poly;
 } line_obj_t;
 
 static mp_obj_t line_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
-  mp_arg_check_num(n_args, n_kw, 5, 6, false);
+  mp_arg_check_num(n_args, n_kw, 5, 6, true);
 
   line_obj_t *self = m_new_obj(line_obj_t);
   self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
 
-  init_transform(&(self->poly.tr));
+  init_polygon(&(self->poly));
 
   self->poly.fill = false;
   self->poly.stroke = true;
+  self->poly.rule = RULE_EVENODD;
   self->poly.sclr = mp_obj_get_int(args[4]);
   self->poly.width = (n_args >= 6) ? mp_obj_get_int(args[5]) : 2;
   if (self->poly.width < 1)
@@ -332,12 +811,14 @@ static mp_obj_t line_make_new(const mp_obj_type_t *type, size_t n_args, size_t n
 
   self->poly.n_pts = 4;
   self->poly.pts = m_new(uint16_t, self->poly.n_pts);
+  self->poly.max_pts = self->poly.n_pts;
 
   int i, j;
   for (i = 0, j = 0; i < 2; i++, j+=2) {
     self->poly.pts[j] = XFX(mp_obj_get_int(args[j]));
     self->poly.pts[j+1] = YFX(mp_obj_get_int(args[j+1]));
   }
+  parse_stroke_args(&(self->poly), n_args, n_kw, args, false);
 
   return MP_OBJ_FROM_PTR(self);
 }
@@ -357,6 +838,7 @@ static void line_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_
     mp_printf(print, ",fill=color%d", self->poly.fclr);
   if (self->poly.stroke) {
     mp_printf(print, ",stroke=color%d,width=%d", self->poly.sclr, self->poly.width);
+    dash_print(print, &(self->poly));
   }
   mp_printf(print, ")@");
   transform_print(print, &(self->poly.tr));
@@ -364,6 +846,11 @@ static void line_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_
 
 static const mp_rom_map_elem_t line_locals_dict_table[] = {
   { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_points), MP_ROM_PTR(&set_points_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_point), MP_ROM_PTR(&set_point_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_width), MP_ROM_PTR(&set_width_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_dash), MP_ROM_PTR(&set_dash_obj) },
 };
 
 static MP_DEFINE_CONST_DICT(line_locals_dict, line_locals_dict_table);
@@ -378,286 +865,624 @@ MP_DEFINE_CONST_OBJ_TYPE(
 );
 
 
+//////////////////////////////////////// Instance
 
-//////////////////////////////////////// Dynamic methods
+typedef struct instance_obj_s {
+  mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
+  instance_t inst;
+  mp_obj_t shape; // keeps the shared geometry alive
+} instance_obj_t;
 
-static transform_t *get_transform(mp_obj_t obj) {
-  transform_t *tr = NULL;
+// Instance(shape, x, y[, color]) draws shape at x,y without copying its
+// geometry, all instances of a shape share its edge table
+static mp_obj_t instance_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 3, 4, false);
 
-  const mp_obj_type_t *otype = mp_obj_get_type(obj);
-  if (otype == &rect_type) {
-    rect_obj_t *rect_obj = (rect_obj_t *)MP_OBJ_TO_PTR(obj);
-    tr = &(rect_obj->rect.tr);
-  } else if (otype == &polygon_type || otype == &polyline_type || otype == &line_type) {
-    polygon_obj_t *polygon_obj = (polygon_obj_t *)MP_OBJ_TO_PTR(obj);
-    tr = &(polygon_obj->poly.tr);
-  }
-  return tr;
-}
+  polygon_t *poly = get_polygon(args[0], NULL);
+  if (poly == NULL)
+    mp_raise_TypeError(MP_ERROR_TEXT("Instance shape must be a Polygon, Polyline or Line"));
 
+  instance_obj_t *self = m_new_obj(instance_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
+  self->shape = args[0];
 
-//////////////////////////////////////// Compile
+  init_transform(&(self->inst.tr));
+  self->inst.tr.tx = XFX(mp_obj_get_int(args[1]));
+  self->inst.tr.ty = YFX(mp_obj_get_int(args[2]));
+  self->inst.poly = poly;
+  self->inst.recolor = (n_args >= 4);
+  self->inst.clr = (n_args >= 4) ? mp_obj_get_int(args[3]) : 0;
 
-static iter_base_t *make_iter(mp_obj_t obj) {
-  const mp_obj_type_t * otype = mp_obj_get_type(obj);
-  if (otype == &rect_type) {
-    rect_obj_t *rect_obj = (rect_obj_t *)MP_OBJ_TO_PTR(obj);
-    rectangle_t *rect = &(rect_obj->rect);
-    rect_iter_t *iter = (rect_iter_t *)m_malloc(sizeof(rect_iter_t));
-    init_rectangle_iter(rect, iter);
-    return (iter_base_t *)iter;
-  } else if (otype == &polygon_type || otype == &polyline_type || otype == &line_type) {
-    polygon_obj_t *polygon_obj = (polygon_obj_t *)MP_OBJ_TO_PTR(obj);
-    polygon_t *poly = &(polygon_obj->poly);
-    poly_iter_t *iter = (poly_iter_t *)m_malloc(sizeof(poly_iter_t));
-    init_polygon_iter(poly, iter);
-    return (iter_base_t *)iter;
-  }
-  return NULL;
+  return MP_OBJ_FROM_PTR(self);
 }
 
-static int sort_runs(uint16_t *runs, uint8_t *clr, int nx) {
-  int n = nx>>1;
-  uint8_t c;
-  uint16_t x1, x2;
-
-  for (int i = 0; i < n; i++) {
-    for (int j = n-1; j > i; j--) {
-      int ri = j<<1;
-      if (runs[ri-2] > runs[ri]) {
-	c = clr[j-1];
-	x1 = runs[ri-2];
-	x2 = runs[ri-1];
-	runs[ri-2] = runs[ri];
-	runs[ri-1] = runs[ri+1];
-	clr[j-1] = clr[j];
-	runs[ri] = x1;
-	runs[ri+1] = x2;
-	clr[j] = c;
-      }
-    }
-  }
-
-  int oc = 1;
-  int oi = 2;
-  int ri = 2;
-  for (int i = 1; i < n; i++) {
-    if (runs[ri] >= runs[oi-1]) {
-      uint16_t dx = runs[ri]-runs[oi-1];
-      // dx 0 is okay, otherwise must meet minimum
-      if (dx != 0) {
-	if (XFX_INT(runs[ri]) == (XFX_INT(runs[oi-1])+1)) {
-	  runs[oi-1] = XFX(XFX_INT(runs[ri]));
-	  runs[ri] = runs[oi-1];
-	} else if (dx < MIN_DX) {
-	  // if < 1 pix and not consecutive x pos the x is same
-	  runs[ri] = runs[oi-1];
-	}
-      }
-    } else {
-      // overlapped
-      runs[ri] = runs[oi-1]; // make abutted
-    }
-    if (runs[ri] < runs[ri+1]) { // not negative run
-      if (runs[oi-1] == runs[ri] && clr[i] == clr[oc-1]) {
-	// abutted, same color can be merged
-	runs[oi-1] = runs[ri+1]; // extend previous, and discard current
-      } else if ((runs[ri+1]-runs[ri]) >= MIN_DX) { // has minimum width
-	if (ri != oi) {
-	  runs[oi] = runs[ri];
-	  runs[oi+1] = runs[ri+1];
-	  clr[oc] = clr[i];
-	}
-	oi += 2;
-	oc += 1;
-      }
-    }
-    ri += 2;
-  }
-  if (oi == 2 && ((runs[1]-runs[0]) < MIN_DX))
-    return 0;
-  return oi;
-}
+static void instance_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
 
-static uint16_t split_span(uint16_t n, uint16_t sz0, uint16_t sz1) {
-  uint16_t m = n - sz0;
-  while (m>sz1) m -= sz1;
-  return (m<MIN_DX) ? (sz0 - (XFX(1)-m)) : sz0;
+  instance_obj_t * self = (instance_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "Instance(");
+  mp_obj_print_helper(print, self->shape, PRINT_REPR);
+  if (self->inst.recolor)
+    mp_printf(print, ",color%d", self->inst.clr);
+  mp_printf(print, ")@");
+  transform_print(print, &(self->inst.tr));
 }
 
+static const mp_rom_map_elem_t instance_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+};
 
-static uint16_t generator(int xres, int yres, mp_obj_t obj_list,
-			  uint8_t *buf, size_t buflen,
-			  void (*emit)(uint8_t *, size_t)) {
-  size_t list_len = 0;
-  mp_obj_t *list = NULL;
-  mp_obj_list_get(obj_list, &list_len, &list);
-  int len = (int)list_len;
-
-  size_t bufpos;
-  uint16_t cmd;
-  uint16_t curY, y, prevY;
-  uint16_t x1, x2, dx, dx0, s, s0, curX;
-  uint8_t c;
-  int i, ri;
+static MP_DEFINE_CONST_DICT(instance_locals_dict, instance_locals_dict_table);
 
-  iter_base_t ** iters =(iter_base_t **)m_malloc(len * sizeof(iter_base_t*));
-  for (int i = 0; i < len; i++)
-    iters[i] = make_iter(list[i]);
+MP_DEFINE_CONST_OBJ_TYPE(
+    instance_type,
+    MP_QSTR_Instance,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)instance_make_new,
+    print, (const void *)instance_print,
+    locals_dict, &instance_locals_dict
+);
 
-  uint16_t * runs = (uint16_t *)m_malloc(2 * MAX_RUNS * sizeof(uint16_t));
-  uint8_t * clr = (uint8_t *)m_malloc(MAX_RUNS * sizeof(uint8_t));
-
-  bufpos = 0;
-
-  prevY = 0xffff;
-  do {
-    // find next closest line
-    curY = 0xffff;
-    for (i = 0; i < len; i++) {
-      if (iters[i] != NULL) {
-	if (iters[i]->nextLine(iters[i], &y)) {
-	  if (y < curY)
-	    curY = y;
-	} else {
-	  MFREE(iters[i], iters[i]->size);
-	  iters[i] = NULL;
-	}
-      }
-    }
-    if (curY == 0xffff || curY >= yres) break;
-
-    // collect runs on this line
-    ri = 0;
-    for (i = 0; i < len; i++) {
-      if (iters[i] != NULL) {
-	while (iters[i]->nextRun(iters[i], curY, &x1, &x2, &c)) {
-	  if (x2 > x1 && x1 < xres && (ri>>1) < MAX_RUNS) {
-	    if (x2 >= xres) x2 = xres-1;
-	    clr[ri>>1] = c;
-	    runs[ri++] = x1;
-	    runs[ri++] = x2;
-	  }
-	}
-      }
-    }
 
-    if (ri > 0)
-      ri = sort_runs(runs, clr, ri);
+//////////////////////////////////////// Trace
 
-    if (ri > 0) {
-      if ((bufpos + 2 + (ri>>1)*MAX_PACKED_SIZE + 2) > buflen) {
-	emit(buf, bufpos);
-	bufpos = 0;
-      }
-#if 0
-      printf("%d>",curY);
-      for (i = 0; i < ri; i+=2)
-	printf("(%f,%f)",runs[i]/16.0,runs[i+1]/16.0);
-      printf("\n");
+typedef struct trace_obj_s {
+  mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
+  trace_t trace;
+} trace_obj_t;
+
+// x distance in pixels, fractions are kept when floats are available
+static uint16_t get_x_step(mp_obj_t obj) {
+#if MICROPY_PY_BUILTINS_FLOAT
+  if (mp_obj_is_float(obj))
+    return (uint16_t)(mp_obj_get_float(obj)*XSCALE + 0.5);
 #endif
-      x1 = runs[0];
-      if (curY > 0) {
-	if (curY == (prevY+1) && x1 <= MAX_NLX) {
-	  cmd = 0xa000|x1;
-	  curX = x1;
-	} else {
-	  cmd = 0xf000|curY;
-	  curX = 0;
-	}
-	buf[bufpos++] = cmd>>8;
-	buf[bufpos++] = cmd&0xff;
-      } else
-	curX = 0;
-      for (i = 0; i < ri; i+=2) {
-	s = runs[i+1] - runs[i];
-	if (s < MIN_DX)
-	  continue;
-
-	dx = runs[i] - curX;
-	if (curY == 0 && curX == 0 && dx < MIN_DX) {
-	  // top-left corner special case
-	  if (runs[i+1] < 2*MIN_DX)
-	    continue; // below minimum span
-	  dx = MIN_DX;
-	  s = runs[i+1] - MIN_DX;
-	}
-	if (dx > 0 && dx < MIN_DX) {
-	  printf("ERR");
-	  for (int k = 0; k < ri; k+=2)
-	    printf(" %d,%d",runs[k],runs[k+1]);
-	  printf("\n");
-	}
-	if (dx > MAX_DX) {
-	  dx0 = split_span(dx, MAX_DX, MAX_DX);
-	  cmd = 0x8000|dx0;
-	  buf[bufpos++] = cmd>>8;
-	  buf[bufpos++] = cmd&0xff;
-	  dx -= dx0;
-	}
-	while (dx > MAX_DX) {
-	  cmd = 0x8000|MAX_DX;
-	  buf[bufpos++] = cmd>>8;
-	  buf[bufpos++] = cmd&0xff;
-	  dx -= MAX_DX;
-	}
-	if (dx > 0) {
-	  cmd = 0x8000|dx;
-	  buf[bufpos++] = cmd>>8;
-	  buf[bufpos++] = cmd&0xff;
-	}
-
-	if (s > MAX_CLRX) {
-	  s0 = split_span(s, MAX_CLRX, MAX_SPANX);
-	  cmd = (((uint16_t)clr[i>>1])<<8)|s0;
-	  s -= s0;
-	} else {
-	  cmd = (((uint16_t)clr[i>>1])<<8)|s;
-	  s = 0;
-	}
-	buf[bufpos++] = cmd>>8;
-	buf[bufpos++] = cmd&0xff;
-	while (s > MAX_SPANX) {
-	  cmd = 0xc000|MAX_SPANX;
-	  buf[bufpos++] = cmd>>8;
-	  buf[bufpos++] = cmd&0xff;
-	  s -= MAX_SPANX;
-	}
-	if (s > 0) {
-	  cmd = 0xc000|s;
-	  buf[bufpos++] = cmd>>8;
-	  buf[bufpos++] = cmd&0xff;
-	}
+  return XFX(mp_obj_get_int(obj));
+}
 
-	curX = runs[i+1];
-      }
-      prevY = curY;
-    } else {
-      // on fail revert curY
-      curY = prevY;
-    }
-  } while (true);
+// Samples: a list of ints or a buffer of int16, negative values clip to 0
+static void load_samples(trace_t *trace, mp_obj_t obj) {
+  mp_buffer_info_t bufinfo;
+  size_t list_len = 0;
+  mp_obj_t *list = NULL;
+  bool is_buf = !mp_obj_is_type(obj, &mp_type_list) && mp_get_buffer(obj, &bufinfo, MP_BUFFER_READ);
+  int n;
+  if (is_buf) {
+    check_int16_buffer(&bufinfo);
+    if (bufinfo.len & 1)
+      mp_raise_ValueError(MP_ERROR_TEXT("Sample buffer must hold int16 values"));
+    n = bufinfo.len >> 1;
+  } else {
+    mp_obj_list_get(obj, &list_len, &list);
+    n = list_len;
+  }
 
-  for (i = 0; i < len; i++) {
-    if (iters[i] != NULL) {
-      MFREE(iters[i], iters[i]->size);
+  // convert and allocate everything before touching the trace, so an
+  // error leaves it as it was
+  if (!is_buf)
+    for (int i = 0; i < n; i++)
+      mp_obj_get_int(list[i]);
+  if (n > trace->max_samples) {
+    uint16_t *samples = m_new(uint16_t, n);
+    uint16_t *order = m_new(uint16_t, n);
+    if (trace->samples != NULL) {
+      MFREE(trace->samples, trace->max_samples * sizeof(uint16_t));
+      MFREE(trace->order, trace->max_samples * sizeof(uint16_t));
     }
+    trace->samples = samples;
+    trace->order = order;
+    trace->max_samples = n;
   }
 
-  MFREE(clr, MAX_RUNS * sizeof(uint8_t));
-  MFREE(runs, 2 * MAX_RUNS * sizeof(uint16_t));
-  MFREE(iters, len * sizeof(iter_base_t*));
-
-  return(bufpos);
+  for (int i = 0; i < n; i++) {
+    int16_t v;
+    if (is_buf)
+      memcpy(&v, (const uint8_t *)bufinfo.buf + 2*i, 2); // buffer may not be aligned
+    else
+      v = mp_obj_get_int(list[i]);
+    trace->samples[i] = (v > 0) ? YFX(v) : 0;
+  }
+  trace->n_samples = n;
+  trace_changed(trace);
 }
 
-#define GEN_BUF_SIZE 100
+// Trace(samples, x0, dx, color[, width]) plots samples as y values spaced
+// dx pixels apart starting at x0
+static mp_obj_t trace_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 4, 5, false);
+
+  trace_obj_t *self = m_new_obj(trace_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
+
+  trace_t *trace = &(self->trace);
+  init_transform(&(trace->tr));
+  trace->tr.tx = XFX(mp_obj_get_int(args[1]));
+  trace->dx = get_x_step(args[2]);
+  trace->clr = mp_obj_get_int(args[3]);
+  trace->width = (n_args >= 5) ? mp_obj_get_int(args[4]) : 2;
+  if (trace->width < 1)
+    mp_raise_ValueError(MP_ERROR_TEXT("Stoke width must be at least 1"));
 
-static mp_obj_t *emit_list;
+  trace->samples = NULL;
+  trace->order = NULL;
+  trace->max_samples = 0;
+  load_samples(trace, args[0]);
 
-static void list_emit(uint8_t *buf, size_t len) {
-  for (size_t i = 0; i < len; i++)
-    mp_obj_list_append(*emit_list, MP_OBJ_NEW_SMALL_INT(buf[i]));
+  return MP_OBJ_FROM_PTR(self);
+}
+
+static void trace_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
+
+  trace_obj_t * self = (trace_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "Trace(%d,dx=%d/%d,color%d,width=%d)@", self->trace.n_samples,
+	    self->trace.dx, XSCALE, self->trace.clr, self->trace.width);
+  transform_print(print, &(self->trace.tr));
+}
+
+static mp_obj_t trace_set_samples(mp_obj_t self_in, mp_obj_t samples) {
+  check_idle(self_in);
+  trace_obj_t * self = (trace_obj_t *)MP_OBJ_TO_PTR(self_in);
+  load_samples(&(self->trace), samples);
+  return self_in;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(trace_set_samples_obj, trace_set_samples);
+
+static const mp_rom_map_elem_t trace_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_samples), MP_ROM_PTR(&trace_set_samples_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_width), MP_ROM_PTR(&set_width_obj) },
+};
+
+static MP_DEFINE_CONST_DICT(trace_locals_dict, trace_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    trace_type,
+    MP_QSTR_Trace,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)trace_make_new,
+    print, (const void *)trace_print,
+    locals_dict, &trace_locals_dict
+);
+
+
+
+//////////////////////////////////////// Path
+
+typedef struct path_obj_s {
+  mp_obj_base_t base;
+  uint16_t busy; // Renderers drawing it
+  path_t path;
+} path_obj_t;
+
+// Path(fill=color[, rule=]) builds an outline from move, line, quad, cubic
+// and close commands which each return the path so they can be chained
+static mp_obj_t path_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 0, 0, true);
+
+  path_obj_t *self = m_new_obj(path_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  self->busy = 0;
+
+  init_path(&(self->path));
+
+  mp_map_t kwargs;
+  mp_map_init_fixed_table(&kwargs, n_kw, args + n_args);
+
+  static const mp_arg_t allowed_args[] = {
+    { MP_QSTR_fill, MP_ARG_REQUIRED | MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_rule, MP_ARG_KW_ONLY | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+  };
+
+  mp_arg_val_t parsed_args[MP_ARRAY_SIZE(allowed_args)];
+  mp_arg_parse_all(0, args, &kwargs, MP_ARRAY_SIZE(allowed_args), allowed_args, parsed_args);
+
+  self->path.fclr = parsed_args[0].u_int;
+  if (parsed_args[1].u_obj != mp_const_none) {
+    qstr rule = mp_obj_str_get_qstr(parsed_args[1].u_obj);
+    if (rule == MP_QSTR_nonzero)
+      self->path.rule = RULE_NONZERO;
+    else if (rule != MP_QSTR_evenodd)
+      mp_raise_ValueError(MP_ERROR_TEXT("Fill rule must be 'evenodd' or 'nonzero'"));
+  }
+
+  return MP_OBJ_FROM_PTR(self);
+}
+
+static void path_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
+
+  path_obj_t * self = (path_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "Path(%d,fill=color%d", self->path.n_cmds, self->path.fclr);
+  if (self->path.rule == RULE_NONZERO)
+    mp_printf(print, ",rule=nonzero");
+  mp_printf(print, ")@");
+  transform_print(print, &(self->path.tr));
+}
+
+// Storage doubles as commands are added so building a path is amortized,
+// and clear() keeps it for the next frame
+static void path_add(mp_obj_t self_in, uint8_t cmd, const mp_obj_t *xy) {
+  check_idle(self_in);
+  path_t *path = &(((path_obj_t *)MP_OBJ_TO_PTR(self_in))->path);
+  int np = 2*path_cmd_points(cmd);
+  if (cmd != PATH_MOVE && path->n_cmds == 0)
+    mp_raise_ValueError(MP_ERROR_TEXT("Path must start with move"));
+  // converted first so a bad coordinate appends nothing
+  uint16_t v[6]; // the three points of a cubic at most
+  for (int i = 0; i < np; i += 2) {
+    v[i] = get_x_step(xy[i]);
+    v[i+1] = YFX(mp_obj_get_int(xy[i+1]));
+  }
+  if (path->n_cmds == path->max_cmds) {
+    int n = (path->max_cmds > 0) ? 2*path->max_cmds : 8;
+    path->cmds = m_renew(uint8_t, path->cmds, path->max_cmds, n);
+    path->max_cmds = n;
+  }
+  if (path->n_pts + np > path->max_pts) {
+    int n = (path->max_pts > 0) ? 2*path->max_pts : 32;
+    path->pts = m_renew(uint16_t, path->pts, path->max_pts, n);
+    path->max_pts = n;
+  }
+  for (int i = 0; i < np; i++)
+    path->pts[path->n_pts++] = v[i];
+  path->cmds[path->n_cmds++] = cmd;
+  path_changed(path);
+}
+
+static mp_obj_t path_move(mp_obj_t self_in, mp_obj_t x, mp_obj_t y) {
+  mp_obj_t xy[2] = { x, y };
+  path_add(self_in, PATH_MOVE, xy);
+  return self_in;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_3(path_move_obj, path_move);
+
+static mp_obj_t path_line(mp_obj_t self_in, mp_obj_t x, mp_obj_t y) {
+  mp_obj_t xy[2] = { x, y };
+  path_add(self_in, PATH_LINE, xy);
+  return self_in;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_3(path_line_obj, path_line);
+
+// quad(cx, cy, x, y)
+static mp_obj_t path_quad(size_t n_args, const mp_obj_t *args) {
+  (void)n_args;
+  path_add(args[0], PATH_QUAD, args+1);
+  return args[0];
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(path_quad_obj, 5, 5, path_quad);
+
+// cubic(c1x, c1y, c2x, c2y, x, y)
+static mp_obj_t path_cubic(size_t n_args, const mp_obj_t *args) {
+  (void)n_args;
+  path_add(args[0], PATH_CUBIC, args+1);
+  return args[0];
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(path_cubic_obj, 7, 7, path_cubic);
+
+static mp_obj_t path_close(mp_obj_t self_in) {
+  path_add(self_in, PATH_CLOSE, NULL);
+  return self_in;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(path_close_obj, path_close);
+
+static mp_obj_t path_clear(mp_obj_t self_in) {
+  check_idle(self_in);
+  path_t *path = &(((path_obj_t *)MP_OBJ_TO_PTR(self_in))->path);
+  path->n_cmds = 0;
+  path->n_pts = 0;
+  path_changed(path);
+  return self_in;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(path_clear_obj, path_clear);
+
+static const mp_rom_map_elem_t path_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_position), MP_ROM_PTR(&set_position_obj) },
+  { MP_ROM_QSTR(MP_QSTR_move), MP_ROM_PTR(&path_move_obj) },
+  { MP_ROM_QSTR(MP_QSTR_line), MP_ROM_PTR(&path_line_obj) },
+  { MP_ROM_QSTR(MP_QSTR_quad), MP_ROM_PTR(&path_quad_obj) },
+  { MP_ROM_QSTR(MP_QSTR_cubic), MP_ROM_PTR(&path_cubic_obj) },
+  { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&path_close_obj) },
+  { MP_ROM_QSTR(MP_QSTR_clear), MP_ROM_PTR(&path_clear_obj) },
+  { MP_ROM_QSTR(MP_QSTR_set_color), MP_ROM_PTR(&set_color_obj) },
+};
+
+static MP_DEFINE_CONST_DICT(path_locals_dict, path_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    path_type,
+    MP_QSTR_Path,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)path_make_new,
+    print, (const void *)path_print,
+    locals_dict, &path_locals_dict
+);
+
+
+
+//////////////////////////////////////// Layer
+
+typedef struct layer_obj_s {
+  mp_obj_base_t base;
+  layer_t layer;
+} layer_obj_t;
+
+static void alloc_ctx(vgr2d_ctx_t *ctx, int xres, int yres, size_t buflen);
+static void free_ctx(vgr2d_ctx_t *ctx);
+static void generator(vgr2d_ctx_t *ctx, mp_obj_t obj_list, span_sink_t *sink);
+
+// Layer(objs, xres, yres) rasterizes objs once into per-line spans. Placed
+// first in a display list it is a static backdrop costing only a merge
+// per line on each frame.
+static mp_obj_t layer_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 3, 3, false);
+
+  int xres = XFX(mp_obj_get_int(args[1]));
+  int yres = mp_obj_get_int(args[2]);
+  if (yres < 1)
+    mp_raise_ValueError(MP_ERROR_TEXT("Layer needs at least one line"));
+
+  layer_obj_t *self = m_new_obj(layer_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+
+  layer_sink_t sink;
+  vgr2d_ctx_t ctx;
+  init_layer(&(self->layer), yres);
+  init_layer_sink(&sink, &(self->layer));
+  alloc_ctx(&ctx, xres, yres, 0);
+  generator(&ctx, args[0], &(sink.base));
+  layer_counted(&(self->layer));
+  generator(&ctx, args[0], &(sink.base));
+  free_ctx(&ctx);
+
+  return MP_OBJ_FROM_PTR(self);
+}
+
+static void layer_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
+
+  layer_obj_t * self = (layer_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "Layer(%d runs,%d lines)", (int)self->layer.n_runs, self->layer.height);
+}
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    layer_type,
+    MP_QSTR_Layer,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)layer_make_new,
+    print, (const void *)layer_print
+);
+
+
+
+//////////////////////////////////////// Dynamic methods
+
+static transform_t *get_transform(mp_obj_t obj) {
+  transform_t *tr = NULL;
+
+  const mp_obj_type_t *otype = mp_obj_get_type(obj);
+  if (otype == &rect_type) {
+    rect_obj_t *rect_obj = (rect_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(rect_obj->rect.tr);
+  } else if (otype == &rect_batch_type) {
+    rect_batch_obj_t *batch_obj = (rect_batch_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(batch_obj->batch.tr);
+  } else if (otype == &polygon_type || otype == &polyline_type || otype == &line_type) {
+    polygon_obj_t *polygon_obj = (polygon_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(polygon_obj->poly.tr);
+  } else if (otype == &instance_type) {
+    instance_obj_t *instance_obj = (instance_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(instance_obj->inst.tr);
+  } else if (otype == &trace_type) {
+    trace_obj_t *trace_obj = (trace_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(trace_obj->trace.tr);
+  } else if (otype == &path_type) {
+    path_obj_t *path_obj = (path_obj_t *)MP_OBJ_TO_PTR(obj);
+    tr = &(path_obj->path.tr);
+  }
+  return tr;
+}
+
+// NULL for objects that cannot change, such as layers
+static uint16_t *get_busy(mp_obj_t obj) {
+  const mp_obj_type_t *otype = mp_obj_get_type(obj);
+  if (otype == &rect_type)
+    return &(((rect_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  else if (otype == &rect_batch_type)
+    return &(((rect_batch_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  else if (otype == &polygon_type || otype == &polyline_type || otype == &line_type)
+    return &(((polygon_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  else if (otype == &instance_type)
+    return &(((instance_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  else if (otype == &trace_type)
+    return &(((trace_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  else if (otype == &path_type)
+    return &(((path_obj_t *)MP_OBJ_TO_PTR(obj))->busy);
+  return NULL;
+}
+
+static rectangle_t *get_rectangle(mp_obj_t obj) {
+  if (mp_obj_get_type(obj) == &rect_type)
+    return &(((rect_obj_t *)MP_OBJ_TO_PTR(obj))->rect);
+  return NULL;
+}
+
+static polygon_t *get_polygon(mp_obj_t obj, bool *closed) {
+  const mp_obj_type_t *otype = mp_obj_get_type(obj);
+  if (otype == &polygon_type || otype == &polyline_type || otype == &line_type) {
+    if (closed != NULL)
+      *closed = (otype == &polygon_type);
+    return &(((polygon_obj_t *)MP_OBJ_TO_PTR(obj))->poly);
+  }
+  return NULL;
+}
+
+static instance_t *get_instance(mp_obj_t obj) {
+  if (mp_obj_get_type(obj) == &instance_type)
+    return &(((instance_obj_t *)MP_OBJ_TO_PTR(obj))->inst);
+  return NULL;
+}
+
+static trace_t *get_trace(mp_obj_t obj) {
+  if (mp_obj_get_type(obj) == &trace_type)
+    return &(((trace_obj_t *)MP_OBJ_TO_PTR(obj))->trace);
+  return NULL;
+}
+
+static path_t *get_path(mp_obj_t obj) {
+  if (mp_obj_get_type(obj) == &path_type)
+    return &(((path_obj_t *)MP_OBJ_TO_PTR(obj))->path);
+  return NULL;
+}
+
+
+//////////////////////////////////////// Compile
+
+// Each object is prepared before its iterator is made, so the sweep only
+// reads it
+static iter_base_t *make_iter(mp_obj_t obj) {
+  const mp_obj_type_t * otype = mp_obj_get_type(obj);
+  if (otype == &rect_type) {
+    rect_obj_t *rect_obj = (rect_obj_t *)MP_OBJ_TO_PTR(obj);
+    rectangle_t *rect = &(rect_obj->rect);
+    rect_iter_t *iter = (rect_iter_t *)m_malloc(sizeof(rect_iter_t));
+    init_rectangle_iter(rect, iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &rect_batch_type) {
+    rect_batch_obj_t *batch_obj = (rect_batch_obj_t *)MP_OBJ_TO_PTR(obj);
+    rect_batch_iter_t *iter = (rect_batch_iter_t *)m_malloc(sizeof(rect_batch_iter_t));
+    prepare_rect_batch(&(batch_obj->batch));
+    init_rect_batch_iter(&(batch_obj->batch), iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &polygon_type || otype == &polyline_type || otype == &line_type) {
+    polygon_obj_t *polygon_obj = (polygon_obj_t *)MP_OBJ_TO_PTR(obj);
+    polygon_t *poly = &(polygon_obj->poly);
+    prepare_polygon(poly);
+    if (poly->fill && poly->stroke) {
+      outline_iter_t *iter = (outline_iter_t *)m_malloc(sizeof(outline_iter_t));
+      init_outline_iter(poly, iter);
+      return (iter_base_t *)iter;
+    }
+    poly_iter_t *iter = (poly_iter_t *)m_malloc(sizeof(poly_iter_t));
+    init_polygon_iter(poly, iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &instance_type) {
+    instance_obj_t *instance_obj = (instance_obj_t *)MP_OBJ_TO_PTR(obj);
+    polygon_t *poly = instance_obj->inst.poly;
+    prepare_instance(&(instance_obj->inst));
+    if (poly->fill && poly->stroke) {
+      outline_iter_t *iter = (outline_iter_t *)m_malloc(sizeof(outline_iter_t));
+      init_instance_outline_iter(&(instance_obj->inst), iter);
+      return (iter_base_t *)iter;
+    }
+    poly_iter_t *iter = (poly_iter_t *)m_malloc(sizeof(poly_iter_t));
+    init_instance_iter(&(instance_obj->inst), iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &trace_type) {
+    trace_obj_t *trace_obj = (trace_obj_t *)MP_OBJ_TO_PTR(obj);
+    trace_iter_t *iter = (trace_iter_t *)m_malloc(sizeof(trace_iter_t));
+    prepare_trace(&(trace_obj->trace));
+    init_trace_iter(&(trace_obj->trace), iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &path_type) {
+    path_obj_t *path_obj = (path_obj_t *)MP_OBJ_TO_PTR(obj);
+    poly_iter_t *iter = (poly_iter_t *)m_malloc(sizeof(poly_iter_t));
+    prepare_path(&(path_obj->path));
+    init_path_iter(&(path_obj->path), iter);
+    return (iter_base_t *)iter;
+  } else if (otype == &layer_type) {
+    layer_obj_t *layer_obj = (layer_obj_t *)MP_OBJ_TO_PTR(obj);
+    layer_iter_t *iter = (layer_iter_t *)m_malloc(sizeof(layer_iter_t));
+    init_layer_iter(&(layer_obj->layer), iter);
+    return (iter_base_t *)iter;
+  }
+  return NULL;
+}
+
+static void release_iter(iter_base_t *iter) {
+  MFREE(iter, iter->size);
+}
+
+// Iterators of the objects in obj_list
+static iter_base_t **make_iters(mp_obj_t obj_list, int *n) {
+  size_t list_len = 0;
+  mp_obj_t *list = NULL;
+  mp_obj_list_get(obj_list, &list_len, &list);
+
+  iter_base_t ** iters =(iter_base_t **)m_malloc(list_len * sizeof(iter_base_t*));
+  for (size_t i = 0; i < list_len; i++)
+    iters[i] = make_iter(list[i]);
+  *n = (int)list_len;
+  return iters;
+}
+
+// Frees the iterators a scan left unfinished, and the list
+static void free_iters(iter_base_t **iters, int n) {
+  for (int i = 0; i < n; i++) {
+    if (iters[i] != NULL) {
+      free_iter_scratch(iters[i]);
+      release_iter(iters[i]);
+    }
+  }
+  MFREE(iters, n * sizeof(iter_base_t*));
+}
+
+// A context with its work area and buflen bytes of output on the heap,
+// the work area holds a run for every pixel of a line
+static void alloc_ctx(vgr2d_ctx_t *ctx, int xres, int yres, size_t buflen) {
+  int max_runs = LINE_RUNS(xres);
+  uint16_t * runs = (uint16_t *)m_malloc(2 * SCAN_RUNS(max_runs) * sizeof(uint16_t));
+  uint8_t * clr = (uint8_t *)m_malloc(SCAN_RUNS(max_runs) * sizeof(uint8_t));
+  uint8_t * buf = (buflen > 0) ? (uint8_t *)m_malloc(buflen) : NULL;
+  init_ctx(ctx, xres, yres, runs, clr, max_runs, buf, buflen);
+  ctx->release = release_iter;
+}
+
+static void free_ctx(vgr2d_ctx_t *ctx) {
+  if (ctx->buf != NULL)
+    MFREE(ctx->buf, ctx->buflen);
+  MFREE(ctx->clr, SCAN_RUNS(ctx->max_runs) * sizeof(uint8_t));
+  MFREE(ctx->runs, 2 * SCAN_RUNS(ctx->max_runs) * sizeof(uint16_t));
+}
+
+// Rasterizes the objects in obj_list line by line into sink
+static void generator(vgr2d_ctx_t *ctx, mp_obj_t obj_list, span_sink_t *sink) {
+  int n;
+  iter_base_t **iters = make_iters(obj_list, &n);
+  ctx_render(ctx, iters, n, sink);
+  free_iters(iters, n);
+}
+
+// Encodes the objects in obj_list to the context's emit, returns the
+// length of the last chunk left in its buffer
+static size_t encode_frame(vgr2d_ctx_t *ctx, mp_obj_t obj_list) {
+  int n;
+  iter_base_t **iters = make_iters(obj_list, &n);
+  size_t bufpos = ctx_encode(ctx, iters, n);
+  free_iters(iters, n);
+  return bufpos;
+}
+
+#define GEN_BUF_SIZE 100
+
+// user is the list the bytes are appended to
+static void list_emit(void *user, uint8_t *buf, size_t len) {
+  mp_obj_t list = MP_OBJ_FROM_PTR(user);
+  for (size_t i = 0; i < len; i++)
+    mp_obj_list_append(list, MP_OBJ_NEW_SMALL_INT(buf[i]));
 }
 
 static mp_obj_t generate(size_t n_args, const mp_obj_t *args) {
@@ -665,22 +1490,18 @@ static mp_obj_t generate(size_t n_args, const mp_obj_t *args) {
   int xres = XFX(mp_obj_get_int(args[2]));
   int yres = mp_obj_get_int(args[3]);
 
-  uint8_t *buf = (uint8_t *)m_malloc(GEN_BUF_SIZE);
-
   mp_obj_t return_list = mp_obj_new_list(0, NULL);
 
   mp_obj_list_append(return_list, MP_OBJ_NEW_SMALL_INT(addr>>8));
   mp_obj_list_append(return_list, MP_OBJ_NEW_SMALL_INT(addr&0xff));
 
-  emit_list = &return_list;
-  uint8_t bufpos = generator(xres, yres, args[1],
-			     buf, GEN_BUF_SIZE, list_emit);
-  // terminator
-  buf[bufpos++] = 0xff;
-  buf[bufpos++] = 0xff;
-  list_emit(buf, bufpos);
-
-  MFREE(buf, GEN_BUF_SIZE);
+  vgr2d_ctx_t ctx;
+  alloc_ctx(&ctx, xres, yres, GEN_BUF_SIZE);
+  ctx.emit = list_emit;
+  ctx.user = MP_OBJ_TO_PTR(return_list);
+  size_t bufpos = encode_frame(&ctx, args[1]);
+  list_emit(ctx.user, ctx.buf, bufpos);
+  free_ctx(&ctx);
 
   return MP_OBJ_FROM_PTR(return_list);
 }
@@ -689,44 +1510,683 @@ STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(generate_fun, 4, 4, generate);
 
 #define SPI_SIZE 254
 
-static void fpga_emit(uint8_t *buf, size_t len) {
+static void fpga_emit(void *user, uint8_t *buf, size_t len) {
+  (void)user;
   fpga_write_internal(buf, len, true);
 }
 
-static mp_obj_t display2d(size_t n_args, const mp_obj_t *args) {
-  uint16_t addr = mp_obj_get_int(args[0]);
-  int xres = XFX(mp_obj_get_int(args[2]));
-  int yres = mp_obj_get_int(args[3]);
+// FNV-1a over the encoded frame, user is the running hash
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
 
-  uint8_t *buf = (uint8_t *)m_malloc(SPI_SIZE);
+static void hash_emit(void *user, uint8_t *buf, size_t len) {
+  uint32_t h = *(uint32_t *)user;
+  for (size_t i = 0; i < len; i++) {
+    h ^= buf[i];
+    h *= FNV_PRIME;
+  }
+  *(uint32_t *)user = h;
+}
+
+// Records the header and every object of a display list with cap. Objects
+// the renderer skips are skipped too unless strict, then they raise.
+static void capture_scene(capture_t *cap, mp_obj_t objs, uint16_t xres, uint16_t yres, bool strict) {
+  size_t list_len = 0;
+  mp_obj_t *list = NULL;
+  mp_obj_list_get(objs, &list_len, &list);
+  capture_header(cap, xres, yres, list_len);
+
+  for (size_t i = 0; i < list_len; i++) {
+    const mp_obj_type_t *otype = mp_obj_get_type(list[i]);
+    if (otype == &rect_type)
+      capture_rect(cap, get_rectangle(list[i]));
+    else if (otype == &rect_batch_type)
+      capture_batch(cap, &(((rect_batch_obj_t *)MP_OBJ_TO_PTR(list[i]))->batch));
+    else if (get_polygon(list[i], NULL) != NULL)
+      capture_polygon(cap, get_polygon(list[i], NULL));
+    else if (otype == &instance_type)
+      capture_instance(cap, get_instance(list[i]));
+    else if (otype == &trace_type)
+      capture_trace(cap, get_trace(list[i]));
+    else if (otype == &path_type)
+      capture_path(cap, get_path(list[i]));
+    else if (otype == &layer_type)
+      capture_layer(cap, &(((layer_obj_t *)MP_OBJ_TO_PTR(list[i]))->layer));
+    else if (strict)
+      mp_raise_TypeError(MP_ERROR_TEXT("Object cannot be captured"));
+  }
+}
+
+// Key of the frame objs encode to: the capture records of the objects,
+// the resolution and the line budget. Hashing these is much cheaper than
+// encoding the frame, so a hit costs no encode and a miss only one.
+static uint32_t scene_hash(vgr2d_ctx_t *ctx, mp_obj_t objs) {
+  uint32_t hash = FNV_OFFSET;
+  capture_t cap = { hash_emit, &hash };
+  capture_scene(&cap, objs, XFX_INT(ctx->xres), ctx->yres, false);
+  uint32_t budget = ctx->budget;
+  hash_emit(&hash, (uint8_t *)&budget, sizeof(budget));
+  return hash;
+}
+
+// What is resident in the FPGA buffers. One table per interpreter so
+// every path writing a buffer, whichever display it belongs to, forgets
+// what the buffer held before. Contexts stay free of it, the table is only
+// touched around the encode.
+#define MAX_RESIDENT 4
+
+typedef struct resident_s {
+  uint16_t addr;
+  bool valid;
+  uint32_t hash;
+  uint32_t degraded; // lines simplified when the frame was encoded
+} resident_t;
+
+// The FPGA buffers of one display
+typedef struct display_s {
+  uint16_t addrs[2];
+  int n_bufs, front;
+  bool cache;
+  uint32_t degraded; // lines simplified in the last frame
+} display_t;
+
+// Module state on the heap, held by a root pointer so the GC keeps it and
+// a soft reset starts from an empty table: the FPGA buffers may have been
+// overwritten by then.
+typedef struct vgr2d_state_s {
+  resident_t resident[MAX_RESIDENT];
+  int resident_next; // entry replaced when the table is full
+  display_t display2d; // state of the display2d() calls
+} vgr2d_state_t;
+
+MP_REGISTER_ROOT_POINTER(struct vgr2d_state_s *vgr2d_state);
+
+static vgr2d_state_t *get_state(void) {
+  if (MP_STATE_PORT(vgr2d_state) == NULL)
+    MP_STATE_PORT(vgr2d_state) = m_new0(vgr2d_state_t, 1);
+  return MP_STATE_PORT(vgr2d_state);
+}
+
+static resident_t *resident_find(uint16_t addr) {
+  resident_t *resident = get_state()->resident;
+  for (int i = 0; i < MAX_RESIDENT; i++)
+    if (resident[i].valid && resident[i].addr == addr)
+      return &resident[i];
+  return NULL;
+}
+
+// Called before anything that overwrites the buffer at addr
+static void resident_forget(uint16_t addr) {
+  resident_t *res = resident_find(addr);
+  if (res != NULL)
+    res->valid = false;
+}
 
+static void resident_set(uint16_t addr, uint32_t hash, uint32_t degraded) {
+  vgr2d_state_t *state = get_state();
+  resident_t *res = resident_find(addr);
+  for (int i = 0; res == NULL && i < MAX_RESIDENT; i++)
+    if (!state->resident[i].valid)
+      res = &state->resident[i];
+  if (res == NULL) {
+    res = &state->resident[state->resident_next];
+    state->resident_next = (state->resident_next + 1) % MAX_RESIDENT;
+  }
+  res->addr = addr;
+  res->valid = true;
+  res->hash = hash;
+  res->degraded = degraded;
+}
+
+// A line must fit at least one span across the whole width, xres in x
+// units
+static size_t get_budget(mp_int_t budget, int xres) {
+  if (budget != 0 && (budget < 0 || (size_t)budget < min_line_budget(xres)))
+    mp_raise_ValueError(MP_ERROR_TEXT("Line budget too small for the resolution"));
+  return budget;
+}
+
+// addr is one buffer address or a tuple of two
+static void display_set_addrs(display_t *disp, mp_obj_t addr_obj) {
+  uint16_t addrs[2];
+  int n_bufs = 1;
+  if (mp_obj_is_int(addr_obj)) {
+    addrs[0] = mp_obj_get_int(addr_obj);
+  } else {
+    mp_obj_t *items;
+    mp_obj_get_array_fixed_n(addr_obj, 2, &items);
+    addrs[0] = mp_obj_get_int(items[0]);
+    addrs[1] = mp_obj_get_int(items[1]);
+    n_bufs = 2;
+  }
+
+  if (n_bufs == 1)
+    disp->front = 0;
+  for (int b = 0; b < n_bufs; b++)
+    disp->addrs[b] = addrs[b];
+  disp->n_bufs = n_bufs;
+}
+
+// Encodes objs to the buffer not shown and returns its address. With two
+// buffers the caller can swap to it without tearing. With caching the
+// upload is skipped when a buffer already holds the same frame.
+static uint16_t display_frame(display_t *disp, vgr2d_ctx_t *ctx, mp_obj_t objs) {
+  int back = (disp->n_bufs == 2) ? 1-disp->front : 0;
+  uint32_t hash = 0;
+
+  if (disp->cache) {
+    hash = scene_hash(ctx, objs);
+
+    // the frame shown, then the other buffer, may already hold this frame
+    int order[2] = { disp->front, back };
+    for (int i = 0; i < disp->n_bufs; i++) {
+      int b = order[i];
+      resident_t *res = resident_find(disp->addrs[b]);
+      if (res != NULL && res->hash == hash) {
+	disp->front = b;
+	disp->degraded = res->degraded;
+	return disp->addrs[b];
+      }
+    }
+  }
+
+  uint16_t addr = disp->addrs[back];
+  resident_forget(addr);
+  uint8_t *buf = ctx->buf;
   buf[0] = fpga_graphics_dev();
   buf[1] = 0x03;
   buf[2] = addr>>8;
   buf[3] = addr&0xff;
   fpga_write_internal(buf, 4, true);
 
-  uint16_t bufpos = generator(xres, yres, args[1],
-			      buf, SPI_SIZE, fpga_emit);
-  // terminator
-  buf[bufpos++] = 0xff;
-  buf[bufpos++] = 0xff;
+  ctx->emit = fpga_emit;
+  ctx->user = NULL;
+  size_t bufpos = encode_frame(ctx, objs);
   fpga_write_internal(buf, bufpos, false);
+  disp->degraded = ctx->degraded;
+
+  if (disp->cache)
+    resident_set(addr, hash, ctx->degraded);
+  disp->front = back;
+  return addr;
+}
+
+// display2d(addr, objs, xres, yres, cache=False, budget=0) encodes objs
+// straight to the FPGA buffer at addr and returns the address holding the
+// frame. addr may be a tuple of two buffers, each frame is then written to
+// the one not last shown so the caller can swap to it without tearing.
+// With cache=True the upload is skipped when a buffer already holds the
+// same frame.
+// A budget limits the bytes of every line, see degraded().
+static mp_obj_t display2d(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+  static const mp_arg_t allowed_args[] = {
+    { MP_QSTR_addr, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_objs, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_xres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_yres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_cache, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+    { MP_QSTR_budget, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+  };
+
+  mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+  mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
 
+  display_t *disp = &get_state()->display2d;
+  display_set_addrs(disp, args[0].u_obj);
+  disp->cache = args[4].u_bool;
+
+  vgr2d_ctx_t ctx;
+  alloc_ctx(&ctx, XFX(args[2].u_int), args[3].u_int, SPI_SIZE);
+  ctx.budget = get_budget(args[5].u_int, ctx.xres);
+  uint16_t addr = display_frame(disp, &ctx, args[1].u_obj);
+  free_ctx(&ctx);
+
+  return MP_OBJ_NEW_SMALL_INT(addr);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(display2d_fun, 4, display2d);
+
+// degraded() is the number of lines display2d simplified in the last frame
+// it uploaded to keep them within the budget
+static mp_obj_t degraded(void) {
+  return mp_obj_new_int_from_uint(get_state()->display2d.degraded);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_0(degraded_fun, degraded);
+
+// Display(addr, xres, yres, cache=False, budget=0) is a display with its
+// own buffers and state, so several can be driven independently:
+//
+//   left = vgr2d.Display((0x0000, 0x8000), 320, 240, cache=True)
+//   right = vgr2d.Display(0x10000, 320, 240)
+//   left.show(objs)
+//   right.show(others)
+typedef struct display_obj_s {
+  mp_obj_base_t base;
+  display_t disp;
+  vgr2d_ctx_t ctx;
+} display_obj_t;
+
+static mp_obj_t display_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  static const mp_arg_t allowed_args[] = {
+    { MP_QSTR_addr, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_xres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_yres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_cache, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+    { MP_QSTR_budget, MP_ARG_KW_ONLY | MP_ARG_INT, {.u_int = 0} },
+  };
+
+  mp_map_t kwargs;
+  mp_map_init_fixed_table(&kwargs, n_kw, args + n_args);
+  mp_arg_val_t parsed_args[MP_ARRAY_SIZE(allowed_args)];
+  mp_arg_parse_all(n_args, args, &kwargs, MP_ARRAY_SIZE(allowed_args), allowed_args, parsed_args);
+
+  display_obj_t *self = m_new_obj(display_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  memset(&(self->disp), 0, sizeof(display_t));
+  display_set_addrs(&(self->disp), parsed_args[0].u_obj);
+  self->disp.cache = parsed_args[3].u_bool;
+  alloc_ctx(&(self->ctx), XFX(parsed_args[1].u_int), parsed_args[2].u_int, SPI_SIZE);
+  self->ctx.budget = get_budget(parsed_args[4].u_int, self->ctx.xres);
+
+  return MP_OBJ_FROM_PTR(self);
+}
+
+static void display_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind) {
+  (void)kind;
+
+  display_obj_t * self = (display_obj_t *)MP_OBJ_TO_PTR(self_in);
+  mp_printf(print, "Display(%d,%dx%d)", self->disp.addrs[self->disp.front],
+	    XFX_INT(self->ctx.xres), self->ctx.yres);
+}
+
+// show(objs) sends a frame, returns the address of the buffer holding it
+static mp_obj_t display_show(mp_obj_t self_in, mp_obj_t objs) {
+  display_obj_t * self = (display_obj_t *)MP_OBJ_TO_PTR(self_in);
+  return MP_OBJ_NEW_SMALL_INT(display_frame(&(self->disp), &(self->ctx), objs));
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(display_show_obj, display_show);
+
+// lines simplified to fit the budget in the last frame
+static mp_obj_t display_degraded(mp_obj_t self_in) {
+  display_obj_t * self = (display_obj_t *)MP_OBJ_TO_PTR(self_in);
+  return mp_obj_new_int_from_uint(self->disp.degraded);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(display_degraded_obj, display_degraded);
+
+static const mp_rom_map_elem_t display_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_show), MP_ROM_PTR(&display_show_obj) },
+  { MP_ROM_QSTR(MP_QSTR_degraded), MP_ROM_PTR(&display_degraded_obj) },
+};
+
+static MP_DEFINE_CONST_DICT(display_locals_dict, display_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    display_type,
+    MP_QSTR_Display,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)display_make_new,
+    print, (const void *)display_print,
+    locals_dict, &display_locals_dict
+);
+
+
+// render(objs, xres, yres, buf) draws objs into buf as xres*yres 8-bit
+// color indices, cleared to 0 first
+static mp_obj_t render(size_t n_args, const mp_obj_t *args) {
+  int xres = mp_obj_get_int(args[1]);
+  int yres = mp_obj_get_int(args[2]);
+
+  mp_buffer_info_t bufinfo;
+  mp_get_buffer_raise(args[3], &bufinfo, MP_BUFFER_WRITE);
+  if (xres < 1 || yres < 1 || bufinfo.len < (size_t)xres*yres)
+    mp_raise_ValueError(MP_ERROR_TEXT("Buffer smaller than xres*yres"));
+
+  framebuffer_t fb;
+  init_framebuffer(&fb, (uint8_t *)bufinfo.buf, xres, yres);
+  memset(bufinfo.buf, 0, (size_t)xres*yres);
+  vgr2d_ctx_t ctx;
+  alloc_ctx(&ctx, XFX(xres), yres, 0);
+  generator(&ctx, args[0], &(fb.base));
+  free_ctx(&ctx);
+
+  return args[3];
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(render_fun, 4, 4, render);
+
+
+//////////////////////////////////////// Scene file
+
+// Output of save() and capture(), passed to the emit functions as user
+typedef struct scene_out_s {
+  mp_obj_t stream;
+  uint8_t *pack; // PackBits output when compressing
+} scene_out_t;
+
+static void stream_write(mp_obj_t stream, const uint8_t *buf, size_t len) {
+  int errcode;
+  mp_stream_write_exactly(stream, buf, len, &errcode);
+  if (errcode != 0)
+    mp_raise_OSError(errcode);
+}
+
+static void scene_emit(void *user, uint8_t *buf, size_t len) {
+  stream_write(((scene_out_t *)user)->stream, buf, len);
+}
+
+static void scene_pack_emit(void *user, uint8_t *buf, size_t len) {
+  scene_out_t *out = (scene_out_t *)user;
+  stream_write(out->stream, out->pack, packbits_encode(buf, len, out->pack));
+}
+
+// save(objs, xres, yres, file, compress=False) writes the encoded frame to
+// an open binary file so display_file() can send it without rasterizing
+static mp_obj_t save(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args) {
+  static const mp_arg_t allowed_args[] = {
+    { MP_QSTR_objs, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_xres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_yres, MP_ARG_REQUIRED | MP_ARG_INT, {.u_int = 0} },
+    { MP_QSTR_file, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE} },
+    { MP_QSTR_compress, MP_ARG_KW_ONLY | MP_ARG_BOOL, {.u_bool = false} },
+  };
+
+  mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+  mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+  int xres = args[1].u_int;
+  int yres = args[2].u_int;
+  bool compress = args[4].u_bool;
+  scene_out_t out = { args[3].u_obj, NULL };
+  mp_get_stream_raise(out.stream, MP_STREAM_OP_WRITE);
+
+  uint8_t hdr[SCENE_HEADER_SIZE];
+  scene_header(hdr, compress ? SCENE_PACKBITS : 0, xres, yres);
+  stream_write(out.stream, hdr, SCENE_HEADER_SIZE);
+
+  vgr2d_ctx_t ctx;
+  alloc_ctx(&ctx, XFX(xres), yres, SPI_SIZE);
+  ctx.emit = scene_emit;
+  ctx.user = &out;
+  if (compress) {
+    out.pack = (uint8_t *)m_malloc(PACKBITS_MAX(SPI_SIZE));
+    ctx.emit = scene_pack_emit;
+  }
+  size_t bufpos = encode_frame(&ctx, args[0].u_obj);
+  ctx.emit(ctx.user, ctx.buf, bufpos);
+
+  if (compress)
+    MFREE(out.pack, PACKBITS_MAX(SPI_SIZE));
+  free_ctx(&ctx);
+  return mp_const_none;
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_KW(save_fun, 4, save);
+
+static size_t stream_read(mp_obj_t stream, uint8_t *buf, size_t len) {
+  int errcode;
+  size_t n = mp_stream_read_exactly(stream, buf, len, &errcode);
+  if (errcode != 0)
+    mp_raise_OSError(errcode);
+  return n;
+}
+
+// display_file(addr, file[, xres, yres]) streams a saved frame to the FPGA
+// buffer at addr a chunk at a time. The resolution, when given, must match
+// the one the file was saved at.
+static mp_obj_t display_file(size_t n_args, const mp_obj_t *args) {
+  uint16_t addr = mp_obj_get_int(args[0]);
+  mp_obj_t stream = args[1];
+  mp_get_stream_raise(stream, MP_STREAM_OP_READ);
+
+  uint8_t flags;
+  uint16_t xres, yres;
+  uint8_t *buf = (uint8_t *)m_malloc(SPI_SIZE);
+  uint8_t *chunk = (uint8_t *)m_malloc(SPI_SIZE);
+  if (stream_read(stream, buf, SCENE_HEADER_SIZE) != SCENE_HEADER_SIZE ||
+      !scene_parse_header(buf, &flags, &xres, &yres))
+    mp_raise_ValueError(MP_ERROR_TEXT("Not a supported scene file"));
+  if (n_args >= 4 && (mp_obj_get_int(args[2]) != xres || mp_obj_get_int(args[3]) != yres))
+    mp_raise_ValueError(MP_ERROR_TEXT("Scene resolution does not match"));
+
+  resident_forget(addr);
+  buf[0] = fpga_graphics_dev();
+  buf[1] = 0x03;
+  buf[2] = addr>>8;
+  buf[3] = addr&0xff;
+  fpga_write_internal(buf, 4, true);
+
+  size_t n;
+  if (flags & SCENE_PACKBITS) {
+    unpacker_t u;
+    init_unpacker(&u, buf, SPI_SIZE, fpga_emit, NULL);
+    while ((n = stream_read(stream, chunk, SPI_SIZE)) > 0)
+      unpacker_put(&u, chunk, n);
+    fpga_write_internal(buf, u.outpos, false);
+  } else {
+    // one chunk is held back so the last one can end the transfer
+    size_t pending = stream_read(stream, buf, SPI_SIZE);
+    while ((n = stream_read(stream, chunk, SPI_SIZE)) > 0) {
+      fpga_write_internal(buf, pending, true);
+      uint8_t *t = buf;
+      buf = chunk;
+      chunk = t;
+      pending = n;
+    }
+    fpga_write_internal(buf, pending, false);
+  }
+
+  MFREE(chunk, SPI_SIZE);
   MFREE(buf, SPI_SIZE);
+  return MP_OBJ_NEW_SMALL_INT(addr);
+}
+
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(display_file_fun, 2, 4, display_file);
+
+
+//////////////////////////////////////// Capture
+
+// capture(objs, file[, xres, yres]) records the objects of a display list
+// to an open binary file for replay by tools/vgr2d_bench.c
+static mp_obj_t capture(size_t n_args, const mp_obj_t *args) {
+  scene_out_t out = { args[1], NULL };
+  capture_t cap = { scene_emit, &out };
+  mp_get_stream_raise(out.stream, MP_STREAM_OP_WRITE);
+
+  uint16_t xres = (n_args >= 4) ? mp_obj_get_int(args[2]) : 0;
+  uint16_t yres = (n_args >= 4) ? mp_obj_get_int(args[3]) : 0;
+  capture_scene(&cap, args[0], xres, yres, true);
+
   return mp_const_none;
 }
 
-STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(display2d_fun, 4, 4, display2d);
+STATIC MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(capture_fun, 2, 4, capture);
+
+
+//////////////////////////////////////// Renderer
+
+// Renderer(addr, objs, xres, yres[, budget]) sends a frame to the FPGA a
+// few lines at a time so other tasks can run in between:
+//
+//   r = vgr2d.Renderer(addr, objs, xres, yres)
+//   while r.step(16):
+//       await asyncio.sleep_ms(0)
+//
+// The objects cannot be changed until the frame is done, and nothing else
+// may use the FPGA link while the frame is in progress. A frame abandoned
+// before step() returns False must be closed to release the link, one
+// that is dropped instead is closed when it is collected.
+typedef struct renderer_obj_s {
+  mp_obj_base_t base;
+  mp_obj_t objs; // tuple of the objects drawn, keeps them alive
+  uint16_t addr;
+  bool started, done;
+  vgr2d_ctx_t ctx;
+  scan_t scan;
+  encoder_t enc;
+} renderer_obj_t;
+
+// Adds d to the busy count of every object, and of the shape of every
+// instance since its geometry is drawn too
+static void renderer_hold(mp_obj_t objs, int d) {
+  size_t len;
+  mp_obj_t *items;
+  mp_obj_tuple_get(objs, &len, &items);
+  for (size_t i = 0; i < len; i++) {
+    uint16_t *busy = get_busy(items[i]);
+    if (busy != NULL)
+      *busy += d;
+    if (mp_obj_get_type(items[i]) == &instance_type)
+      *get_busy(((instance_obj_t *)MP_OBJ_TO_PTR(items[i]))->shape) += d;
+  }
+}
+
+static mp_obj_t renderer_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args) {
+  mp_arg_check_num(n_args, n_kw, 4, 5, false);
+
+  renderer_obj_t *self = m_new_obj_with_finaliser(renderer_obj_t);
+  self->base.type = (mp_obj_type_t *)type;
+  // done until the objects are held, so a failed constructor leaves the
+  // finaliser nothing to close
+  self->started = false;
+  self->done = true;
+  self->addr = mp_obj_get_int(args[0]);
+
+  // a copy so changes to the list cannot unbalance the busy counts
+  size_t len = 0;
+  mp_obj_t *list = NULL;
+  mp_obj_list_get(args[1], &len, &list);
+  self->objs = mp_obj_new_tuple(len, list);
+
+  int n;
+  iter_base_t **iters = make_iters(args[1], &n);
+  alloc_ctx(&(self->ctx), XFX(mp_obj_get_int(args[2])), mp_obj_get_int(args[3]), SPI_SIZE);
+  ctx_scan(&(self->ctx), &(self->scan), iters, n);
+  init_encoder(&(self->enc), self->ctx.buf, SPI_SIZE, fpga_emit, NULL);
+  if (n_args >= 5)
+    self->enc.budget = get_budget(mp_obj_get_int(args[4]), self->ctx.xres);
+  renderer_hold(self->objs, 1);
+  self->done = false;
+
+  return MP_OBJ_FROM_PTR(self);
+}
+
+// Frees the frame state and lets the objects change again
+static void renderer_finish(renderer_obj_t *self) {
+  self->done = true;
+  renderer_hold(self->objs, -1);
+  free_iters(self->scan.iters, self->scan.n_iters);
+  free_ctx(&(self->ctx));
+}
+
+// close() abandons a frame in progress, ending the transfer so the FPGA
+// link is free again. step() does the same when it fails.
+static mp_obj_t renderer_close(mp_obj_t self_in) {
+  renderer_obj_t * self = (renderer_obj_t *)MP_OBJ_TO_PTR(self_in);
+  if (self->done)
+    return mp_const_none;
+  renderer_finish(self);
+  if (self->started) {
+    uint8_t end[2] = { 0xff, 0xff };
+    fpga_write_internal(end, 2, false);
+  }
+  return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(renderer_close_obj, renderer_close);
+
+// step([lines]) encodes and sends at most lines scanlines, returns False
+// once the frame is complete
+static mp_obj_t renderer_step(size_t n_args, const mp_obj_t *args) {
+  renderer_obj_t * self = (renderer_obj_t *)MP_OBJ_TO_PTR(args[0]);
+  int lines = (n_args >= 2) ? mp_obj_get_int(args[1]) : 16;
+  uint8_t *buf = self->ctx.buf;
+
+  if (lines < 1)
+    mp_raise_ValueError(MP_ERROR_TEXT("Lines must be at least 1"));
+  if (self->done)
+    return mp_const_false;
+
+  nlr_buf_t nlr;
+  if (nlr_push(&nlr) != 0) {
+    renderer_close(args[0]);
+    nlr_jump(nlr.ret_val);
+  }
+
+  if (!self->started) {
+    buf[0] = fpga_graphics_dev();
+    buf[1] = 0x03;
+    buf[2] = self->addr>>8;
+    buf[3] = self->addr&0xff;
+    resident_forget(self->addr);
+    fpga_write_internal(buf, 4, true);
+    self->started = true;
+  }
+
+  bool more = true;
+  for (int i = 0; more && i < lines; i++)
+    more = scan_line(&(self->scan), &(self->enc.base));
+  if (!more) {
+    // terminator
+    size_t bufpos = self->enc.bufpos;
+    buf[bufpos++] = 0xff;
+    buf[bufpos++] = 0xff;
+    fpga_write_internal(buf, bufpos, false);
+    renderer_finish(self);
+  }
+  nlr_pop();
+  return mp_obj_new_bool(more);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(renderer_step_obj, 1, 2, renderer_step);
+
+// lines simplified to fit the budget so far
+static mp_obj_t renderer_degraded(mp_obj_t self_in) {
+  renderer_obj_t * self = (renderer_obj_t *)MP_OBJ_TO_PTR(self_in);
+  return mp_obj_new_int_from_uint(self->enc.degraded);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(renderer_degraded_obj, renderer_degraded);
+
+static const mp_rom_map_elem_t renderer_locals_dict_table[] = {
+  { MP_ROM_QSTR(MP_QSTR_step), MP_ROM_PTR(&renderer_step_obj) },
+  { MP_ROM_QSTR(MP_QSTR_close), MP_ROM_PTR(&renderer_close_obj) },
+  { MP_ROM_QSTR(MP_QSTR___del__), MP_ROM_PTR(&renderer_close_obj) },
+  { MP_ROM_QSTR(MP_QSTR_degraded), MP_ROM_PTR(&renderer_degraded_obj) },
+};
+
+static MP_DEFINE_CONST_DICT(renderer_locals_dict, renderer_locals_dict_table);
+
+MP_DEFINE_CONST_OBJ_TYPE(
+    renderer_type,
+    MP_QSTR_Renderer,
+    MP_TYPE_FLAG_NONE,
+    make_new, (const void *)renderer_make_new,
+    locals_dict, &renderer_locals_dict
+);
 
 static const mp_rom_map_elem_t module_globals_table[] = {
     { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_rvgr) },
     { MP_ROM_QSTR(MP_QSTR_Rect), MP_ROM_PTR(&rect_type) },
+    { MP_ROM_QSTR(MP_QSTR_RectBatch), MP_ROM_PTR(&rect_batch_type) },
     { MP_ROM_QSTR(MP_QSTR_Polygon), MP_ROM_PTR(&polygon_type) },
     { MP_ROM_QSTR(MP_QSTR_Polyline), MP_ROM_PTR(&polyline_type) },
     { MP_ROM_QSTR(MP_QSTR_Line), MP_ROM_PTR(&line_type) },
+    { MP_ROM_QSTR(MP_QSTR_Instance), MP_ROM_PTR(&instance_type) },
+    { MP_ROM_QSTR(MP_QSTR_Trace), MP_ROM_PTR(&trace_type) },
+    { MP_ROM_QSTR(MP_QSTR_Path), MP_ROM_PTR(&path_type) },
+    { MP_ROM_QSTR(MP_QSTR_Layer), MP_ROM_PTR(&layer_type) },
     { MP_ROM_QSTR(MP_QSTR_generate), MP_ROM_PTR(&generate_fun) },
     { MP_ROM_QSTR(MP_QSTR_display2d), MP_ROM_PTR(&display2d_fun) },
+    { MP_ROM_QSTR(MP_QSTR_degraded), MP_ROM_PTR(&degraded_fun) },
+    { MP_ROM_QSTR(MP_QSTR_Display), MP_ROM_PTR(&display_type) },
+    { MP_ROM_QSTR(MP_QSTR_Renderer), MP_ROM_PTR(&renderer_type) },
+    { MP_ROM_QSTR(MP_QSTR_render), MP_ROM_PTR(&render_fun) },
+    { MP_ROM_QSTR(MP_QSTR_save), MP_ROM_PTR(&save_fun) },
+    { MP_ROM_QSTR(MP_QSTR_display_file), MP_ROM_PTR(&display_file_fun) },
+    { MP_ROM_QSTR(MP_QSTR_capture), MP_ROM_PTR(&capture_fun) },
 };
 static MP_DEFINE_CONST_DICT(module_globals, module_globals_table);
 
@@ -23,13 +23,21 @@ limitations under the License.
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "vgr2dlib.h"
 
 #define ABS(a)		(((a)<0) ? -(a) : (a))
 #define SIGN(x) ((x)>=0 ? 1 : -1)
 #define UDIFF(a,b) ((a)>(b) ? (a)-(b) : 0)
 
+#define MAX_DX 0x1fff // 9.4
+#define MAX_NLX 0x1fff // 9.4
+#define MAX_SPANX 0x1fff // 9.4
+#define MAX_CLRX 0xff // 4.4
+#define MIN_DX 0x10
+
 extern void *vgr2d_alloc(size_t size, int n);
+extern void vgr2d_free(void *ptr, size_t size, int n);
 
 
 //////////////////////////////////////// Utils
@@ -51,22 +59,102 @@ void list_minmax(uint16_t *pts, int n, uint16_t *minx_p, uint16_t *maxx_p, uint1
   }
 }
 
+static uint32_t isqrt(uint32_t v) {
+  uint32_t r = 0, bit = 1UL << 30;
+  while (bit > v)
+    bit >>= 2;
+  while (bit != 0) {
+    if (v >= r + bit) {
+      v -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+static int contour_start(polygon_t *poly, int k) {
+  return (k > 0) ? poly->ends[k-1] : 0;
+}
+
+static int contour_end(polygon_t *poly, int k) {
+  return (poly->n_contours > 1) ? poly->ends[k] : poly->n_pts;
+}
+
+
+// in the Scan section
+static int sort_runs(uint16_t *runs, uint8_t *clr, int nx);
+static int overlay_runs(uint16_t *base, uint8_t *bclr, int nb,
+			uint16_t *top, uint8_t *tclr, int nt,
+			uint16_t *out, uint8_t *oclr, int max);
 
 //////////////////////////////////////// Edge
 
-static void fill_edges(uint16_t id, uint16_t *pts, int n, int y0, edge_t **edges) {
+// Advance x by one line, constant time whatever the slope
+static void edge_step(edge_t *e) {
+  if (e->xNowNumStep == 0 && e->xStepWhole == 0)
+    return; // vertical
+  e->xNowWhole += e->xStepWhole;
+  e->xNowNum += e->xNowNumStep;
+  if (e->xNowNum >= e->xNowDen) {
+    e->xNowWhole += e->xNowDir;
+    e->xNowNum -= e->xNowDen;
+  }
+}
+
+// Sets up the edge from X1,Y1 to X2,Y2 which must not be level
+static void edge_set(edge_t *e, uint16_t id, int X1, int Y1, int X2, int Y2) {
+  int DX = ABS(X1-X2);
+  e->id = id;
+  e->wind = (Y2 > Y1) ? 1 : -1;
+  if (Y2 > Y1) {
+    e->yTop = Y1;
+    e->yBot = Y2;
+    e->xNowWhole = X1;
+    e->xNowDir = SIGN(X2 - X1);
+  } else {
+    e->yTop = Y2;
+    e->yBot = Y1;
+    e->xNowWhole = X2;
+    e->xNowDir = SIGN(X1 - X2);
+  }
+  e->xNowDen = e->yBot - e->yTop;
+  e->xNowNum = (e->xNowDen >> 1);
+  // split the x change per line into whole and fractional parts
+  e->xStepWhole = e->xNowDir * (DX / e->xNowDen);
+  e->xNowNumStep = DX % e->xNowDen;
+}
+
+// When the next non-level edge continues in the same direction the shared
+// vertex belongs to only one of them, so the line isn't crossed twice.
+static void edge_join(edge_t *e, int next_wind) {
+  if (e->wind != next_wind)
+    return;
+  if (e->wind > 0) {
+    e->yBot--;
+  } else {
+    e->yTop++;
+    edge_step(e);
+  }
+}
+
+// Append the edges of a closed contour to edges, returns the new count.
+// A contour of fewer than two points, such as an empty one, has none.
+static int fill_edges(uint16_t id, uint16_t *pts, int n, edge_t *edges, int n_edges) {
   int i, j;
-  int X1,Y1,X2,Y2,Y3;
+  int Y1,Y2,Y3;
   edge_t *e;
 
+  if (n < 4)
+    return n_edges;
   i=0;
   do {
     i += 2;
     if (i == n)
       break;
-    X1 = pts[i-2];
     Y1 = pts[i-1];
-    X2 = pts[i];
     Y2 = pts[i+1];
     if (Y1==Y2)
       continue;   /* Skip horiz. edges */
@@ -80,37 +168,36 @@ static void fill_edges(uint16_t id, uint16_t *pts, int n, int y0, edge_t **edges
       if (Y2 != Y3)
 	break;
     } while (1);
-    e = (edge_t *) vgr2d_alloc(sizeof(edge_t), 1);
-    e->id = id;
-    e->xNowNumStep = ABS(X1-X2);
-    if (Y2 > Y1) {
-      e->yTop = Y1;
-      e->yBot = Y2;
-      e->xNowWhole = X1;
-      e->xNowDir = SIGN(X2 - X1);
-      e->xNowDen = e->yBot - e->yTop;
-      e->xNowNum = (e->xNowDen >> 1);
-      if (Y3 > Y2)
-	e->yBot--;
-    } else {
-      e->yTop = Y2;
-      e->yBot = Y1;
-      e->xNowWhole = X2;
-      e->xNowDir = SIGN(X1 - X2);
-      e->xNowDen = e->yBot - e->yTop;
-      e->xNowNum = (e->xNowDen >> 1);
-      if (Y3 < Y2) {
-	e->yTop++;
-	e->xNowNum += e->xNowNumStep;
-	while (e->xNowNum >= e->xNowDen) {
-	  e->xNowWhole += e->xNowDir;
-	  e->xNowNum -= e->xNowDen;
-	}
-      }
-    }
-    e->next = edges[YFX_INT(e->yTop) - y0];
-    edges[YFX_INT(e->yTop) - y0] = e;
+    e = &edges[n_edges++];
+    edge_set(e, id, pts[i-2], Y1, pts[i], Y2);
+    edge_join(e, (Y3 > Y2) ? 1 : -1);
   } while (1);
+  return n_edges;
+}
+
+static void init_edge_table(edge_table_t *tab) {
+  tab->edges = NULL;
+  tab->bots = NULL;
+  tab->n_edges = 0;
+  tab->max_edges = 0;
+  tab->max_active = 0;
+  tab->valid = false;
+}
+
+// Shell sort by yTop, in place since edge tables can be large
+static void sort_edges(edge_t *edges, int n) {
+  int gap, i, j;
+  edge_t e;
+
+  for (gap = 1; gap < n/3; gap = 3*gap+1);
+  for (; gap > 0; gap /= 3) {
+    for (i = gap; i < n; i++) {
+      e = edges[i];
+      for (j = i; j >= gap && edges[j-gap].yTop > e.yTop; j -= gap)
+	edges[j] = edges[j-gap];
+      edges[j] = e;
+    }
+  }
 }
 
 
@@ -129,22 +216,26 @@ bool rect_next_line(void *arg, uint16_t* y) {
   return (*y <= iter->y2);
 }
 
-bool rect_next_run(void *arg, uint16_t y, uint16_t* x1, uint16_t *x2, uint8_t* clr) {
+int rect_line_runs(void *arg, uint16_t y, uint16_t* runs, uint8_t* clr, int max) {
   rect_iter_t * iter = (rect_iter_t *)arg;
   if (iter->y == y) {
-    *x1 = iter->x1;
-    *x2 = iter->x2;
-    *clr = iter->clr;
     iter->y += 1;
-    return true;
+    if (max > 0) {
+      runs[0] = iter->x1;
+      runs[1] = iter->x2;
+      clr[0] = iter->clr;
+      return 1;
+    }
   }
-  return false;
+  return 0;
 };
 
 void init_rectangle_iter(rectangle_t *rect, rect_iter_t *iter) {
   iter->base.size = sizeof(rect_iter_t);
+  iter->base.resolved = false;
   iter->base.nextLine = rect_next_line;
-  iter->base.nextRun = rect_next_run;
+  iter->base.lineRuns = rect_line_runs;
+  iter->base.freeScratch = NULL;
   iter->x1 = (uint16_t)rect->tr.tx;
   iter->x2 = iter->x1 + XFX(rect->w-1);
   iter->y = (uint16_t)rect->tr.ty;
@@ -153,120 +244,363 @@ void init_rectangle_iter(rectangle_t *rect, rect_iter_t *iter) {
 }
 
 
+//////////////////////////////////////// Rectangle batch
+
+// Shell sort of the rect indices by y, only redone after y changes
+static void sort_rect_order(rect_batch_t *batch) {
+  int gap, i, j;
+  uint16_t r;
+
+  for (gap = 1; gap < batch->n/3; gap = 3*gap+1);
+  for (; gap > 0; gap /= 3) {
+    for (i = gap; i < batch->n; i++) {
+      r = batch->order[i];
+      for (j = i; j >= gap && batch->y[batch->order[j-gap]] > batch->y[r]; j -= gap)
+	batch->order[j] = batch->order[j-gap];
+      batch->order[j] = r;
+    }
+  }
+  batch->sorted = true;
+}
+
+static void rect_batch_advance(rect_batch_iter_t *iter, uint16_t curY) {
+  rect_batch_t *batch = iter->batch;
+  int i, j, k;
+  uint16_t r;
+
+  // filter out finished rects
+  for (i = 0, j = 0; i < iter->n_active; i++) {
+    r = iter->active[i];
+    if (batch->y[r] + batch->h[r] > curY)
+      iter->active[j++] = r;
+  }
+
+  do {
+    // push rects starting, keeping the active set in x order
+    while (iter->idx < batch->n && batch->y[batch->order[iter->idx]] <= curY) {
+      r = batch->order[iter->idx++];
+      if (batch->w[r] == 0 || batch->y[r] + batch->h[r] <= curY)
+	continue;
+      for (k = j; k > 0 && batch->x[iter->active[k-1]] > batch->x[r]; k--)
+	iter->active[k] = iter->active[k-1];
+      iter->active[k] = r;
+      j++;
+    }
+    // gap between rects, jump to the next one
+    if (j == 0 && iter->idx < batch->n)
+      curY = batch->y[batch->order[iter->idx]];
+    else
+      break;
+  } while (true);
+  iter->n_active = j;
+  iter->y = curY;
+}
+
+static bool rect_batch_next_line(void *arg, uint16_t* y) {
+  rect_batch_iter_t * iter = (rect_batch_iter_t *)arg;
+  *y = iter->ty + iter->y;
+  return (iter->n_active > 0);
+}
+
+// The active set is in x order, so if a line holds more bars than the scan
+// has room for, a run per pixel of the display, those on the right are cut
+static int rect_batch_line_runs(void *arg, uint16_t yin, uint16_t* runs, uint8_t* clr, int max) {
+  rect_batch_iter_t * iter = (rect_batch_iter_t *)arg;
+  rect_batch_t *batch = iter->batch;
+  uint16_t y = yin - iter->ty;
+  int i, n = 0;
+
+  if (y == iter->y && iter->n_active > 0) {
+    for (i = 0; i < iter->n_active && n < max; i++) {
+      uint16_t r = iter->active[i];
+      runs[2*n] = iter->tx + batch->x[r];
+      runs[2*n+1] = runs[2*n] + XFX(batch->w[r]-1);
+      clr[n++] = batch->clr[r];
+    }
+    rect_batch_advance(iter, y+1);
+  }
+  return n;
+}
+
+void prepare_rect_batch(rect_batch_t *batch) {
+  if (!batch->sorted)
+    sort_rect_order(batch);
+}
+
+static void rect_batch_free_scratch(void *arg) {
+  rect_batch_iter_t *iter = (rect_batch_iter_t *)arg;
+  vgr2d_free(iter->active, sizeof(uint16_t), iter->max_active);
+}
+
+void init_rect_batch_iter(rect_batch_t *batch, rect_batch_iter_t *iter) {
+  iter->base.size = sizeof(rect_batch_iter_t);
+  iter->base.resolved = false;
+  iter->base.nextLine = rect_batch_next_line;
+  iter->base.lineRuns = rect_batch_line_runs;
+  iter->base.freeScratch = rect_batch_free_scratch;
+  iter->batch = batch;
+  iter->active = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), batch->n);
+  iter->max_active = batch->n;
+  iter->n_active = 0;
+  iter->idx = 0;
+  iter->tx = (uint16_t)batch->tr.tx;
+  iter->ty = (uint16_t)batch->tr.ty;
+  rect_batch_advance(iter, (batch->n > 0) ? batch->y[batch->order[0]] : 0);
+}
+
+
 //////////////////////////////////////// Polygon
 
+void init_polygon(polygon_t *poly) {
+  init_transform(&(poly->tr));
+  poly->pts = NULL;
+  poly->ends = NULL;
+  poly->n_pts = 0;
+  poly->n_contours = 1;
+  poly->max_pts = 0;
+  poly->max_contours = 0;
+  init_edge_table(&(poly->fill_tab));
+  init_edge_table(&(poly->stroke_tab));
+  poly->dash = NULL;
+  poly->n_dash = 0;
+  poly->max_dash = 0;
+  poly->tol = 0;
+  poly->dropped = 0;
+  poly->keep = NULL;
+  poly->max_keep = 0;
+  polygon_changed(poly);
+}
+
+// Must be called whenever the points, width or dash of a polygon change
+void polygon_changed(polygon_t *poly) {
+  poly->fill_tab.valid = false;
+  poly->stroke_tab.valid = false;
+}
+
+static void reserve_edges(edge_table_t *tab, int n) {
+  if (n > tab->max_edges) {
+    if (tab->edges != NULL) {
+      vgr2d_free(tab->edges, sizeof(edge_t), tab->max_edges);
+      vgr2d_free(tab->bots, sizeof(int16_t), tab->max_edges);
+    }
+    tab->edges = (edge_t *)vgr2d_alloc(sizeof(edge_t), n);
+    tab->bots = (int16_t *)vgr2d_alloc(sizeof(int16_t), n);
+    tab->max_edges = n;
+  }
+  tab->n_edges = 0;
+  tab->max_active = 0;
+}
+
+// Counts the most edges crossing one line of a sorted table, so iterators
+// size their active list up front. At each yTop the active edges are those
+// started minus those ended above it, an edge whose yBot was moved above
+// its yTop by a join still being active on its first line.
+static void count_active(edge_table_t *tab) {
+  int n = tab->n_edges;
+  int16_t *bots = tab->bots, b;
+  int gap, i, j;
+
+  for (i = 0; i < n; i++)
+    bots[i] = (tab->edges[i].yBot > tab->edges[i].yTop) ? tab->edges[i].yBot : tab->edges[i].yTop;
+  for (gap = 1; gap < n/3; gap = 3*gap+1);
+  for (; gap > 0; gap /= 3) {
+    for (i = gap; i < n; i++) {
+      b = bots[i];
+      for (j = i; j >= gap && bots[j-gap] > b; j -= gap)
+	bots[j] = bots[j-gap];
+      bots[j] = b;
+    }
+  }
+
+  tab->max_active = 0;
+  for (i = 0, j = 0; i < n; i++) {
+    int16_t y = tab->edges[i].yTop;
+    if (i+1 < n && tab->edges[i+1].yTop == y)
+      continue;
+    while (j < n && bots[j] < y)
+      j++;
+    if (i+1-j > tab->max_active)
+      tab->max_active = i+1-j;
+  }
+}
+
+static void poly_free_scratch(void *arg) {
+  poly_iter_t *iter = (poly_iter_t *)arg;
+  int n = iter->max_active;
+  if (iter->active == iter->active_buf)
+    return;
+  vgr2d_free(iter->active, sizeof(edge_t), n);
+  vgr2d_free(iter->x_coords, sizeof(int16_t), n);
+  vgr2d_free(iter->idmap, sizeof(uint16_t), n);
+  vgr2d_free(iter->wind, sizeof(int8_t), n);
+  vgr2d_free(iter->past_ids, sizeof(uint16_t), n);
+  vgr2d_free(iter->past_x, sizeof(int16_t), n);
+}
+
+// The active list starts in the iterator and moves to the heap when the
+// table has more edges crossing one line
+static void reserve_active(poly_iter_t *iter, int n) {
+  edge_t *active = (edge_t *)vgr2d_alloc(sizeof(edge_t), n);
+  memcpy(active, iter->active, iter->n_active*sizeof(edge_t));
+  poly_free_scratch(iter);
+  iter->active = active;
+  iter->x_coords = (int16_t *)vgr2d_alloc(sizeof(int16_t), n);
+  iter->idmap = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), n);
+  iter->wind = (int8_t *)vgr2d_alloc(sizeof(int8_t), n);
+  iter->past_ids = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), n);
+  iter->past_x = (int16_t *)vgr2d_alloc(sizeof(int16_t), n);
+  iter->max_active = n;
+}
+
 static void poly_advance(poly_iter_t *iter, uint16_t curY) {
   int i, j;
   int subY = YFX(curY);
   // filter out finished edges
   for (i = 0, j = 0; i < iter->n_active; i++) {
-    edge_t *e = iter->active[i];
-    if (e->yBot >= subY)
-      iter->active[j++] = e;
+    if (iter->active[i].yBot >= subY) {
+      if (i != j)
+	iter->active[j] = iter->active[i];
+      j++;
+    }
   }
 
-  // push new edges starting
-  int idx = curY-iter->y0;
-  if (idx < iter->n_edges) {
-    edge_t *cur = iter->edges[idx];
-    while (cur != NULL && j < MAX_ACTIVE) {
-      iter->active[j++] = cur;
-      cur = cur->next;
+  // push new edges starting, copied since the edge table is shared
+  while (iter->idx < iter->n_edges && iter->edges[iter->idx].yTop <= subY) {
+    if (j == iter->max_active) {
+      iter->n_active = j;
+      reserve_active(iter, 2*j);
     }
-    iter->idx = idx;
-  } else
-    iter->idx = iter->n_edges;
+    iter->active[j++] = iter->edges[iter->idx];
+    iter->idx++;
+  }
   iter->n_active = j;
   iter->y = curY;
 }
 
 static void poly_get_active(poly_iter_t *iter) {
-  int num_coords, i, j;
+  int i, j;
 
   poly_advance(iter, iter->y);
-  while (iter->n_active == 0 && iter->idx < iter->n_edges) {
-    iter->y += 1;
+  if (iter->n_active == 0 && iter->idx < iter->n_edges) {
+    // vertical gap in the shape, jump straight to the next pending edge
+    poly_advance(iter, YFX_INT(iter->edges[iter->idx].yTop));
   }
 
-  // sort and update
-  num_coords = 0;
+  // the active list stays in x order from line to line, so sorting it
+  // in place is close to linear however many edges are active
+  for (i = 1; i < iter->n_active; i++) {
+    edge_t e = iter->active[i];
+    for (j = i; j > 0 && iter->active[j-1].xNowWhole > e.xNowWhole; j--)
+      iter->active[j] = iter->active[j-1];
+    iter->active[j] = e;
+  }
   for (i = 0; i < iter->n_active; i++) {
-    edge_t *e = iter->active[i];
-    int16_t x = e->xNowWhole;
-    for (j = num_coords; j > 0 && iter->x_coords[j-1] > x; j--) {
-      iter->x_coords[j] = iter->x_coords[j-1];
-      iter->idmap[j] = iter->idmap[j-1];
-    }
-    iter->x_coords[j] = x;
-    iter->idmap[j] = e->id;
-    num_coords++;
-    e->xNowNum += e->xNowNumStep;
-    while (e->xNowNum >= e->xNowDen) {
-      e->xNowWhole += e->xNowDir;
-      e->xNowNum -= e->xNowDen;
-    }
+    edge_t *e = &iter->active[i];
+    iter->x_coords[i] = e->xNowWhole;
+    iter->idmap[i] = e->id;
+    iter->wind[i] = e->wind;
+    edge_step(e);
   }
 
   iter->cur = 0;
 }
 
+static void poly_start(poly_iter_t *iter, edge_table_t *tab) {
+  iter->edges = tab->edges;
+  iter->n_edges = tab->n_edges;
+  iter->idx = 0;
+  iter->n_active = 0;
+  iter->active = iter->active_buf;
+  iter->x_coords = iter->x_buf;
+  iter->idmap = iter->id_buf;
+  iter->wind = iter->wind_buf;
+  iter->past_ids = iter->past_id_buf;
+  iter->past_x = iter->past_x_buf;
+  iter->max_active = MAX_ACTIVE;
+  iter->base.freeScratch = poly_free_scratch;
+  if (tab->max_active > MAX_ACTIVE)
+    reserve_active(iter, tab->max_active);
+  iter->y = (tab->n_edges > 0) ? YFX_INT(tab->edges[0].yTop) : 0;
+  poly_get_active(iter);
+}
+
 static bool poly_next_line(void *arg, uint16_t* y) {
   poly_iter_t * iter = (poly_iter_t *)arg;
   *y = iter->ty + iter->y;
   return (iter->n_active > 0);
 }
 
-static bool polyfill_next_run(void *arg, uint16_t yin, uint16_t* x1out, uint16_t *x2out, uint8_t* clr) {
-  uint16_t X1, X2;
+// index of the crossing that closes the span opened at crossing i
+static int fill_span_end(poly_iter_t *iter, int i) {
+  if (iter->rule == RULE_NONZERO) {
+    int w = iter->wind[i];
+    while (++i < iter->n_active) {
+      w += iter->wind[i];
+      if (w == 0)
+	break;
+    }
+  } else
+    i += 1;
+  // unbalanced crossings if edges were dropped
+  return (i < iter->n_active) ? i : iter->n_active-1;
+}
+
+static int polyfill_line_runs(void *arg, uint16_t yin, uint16_t* runs, uint8_t* clr, int max) {
+  int n = 0;
   poly_iter_t * iter = (poly_iter_t *)arg;
   uint16_t y = yin - iter->ty;
   
   if (y == iter->y && iter->cur < iter->n_active) {
-    X1 = iter->x_coords[iter->cur];
-    X2 = iter->x_coords[iter->cur+1];
-    *x1out = iter->tx + X1;
-    *x2out = iter->tx + X2;
-    *clr = iter->fclr;
-    iter->cur += 2;
-    if (iter->cur >= iter->n_active) {
-      iter->y += 1;
-      poly_get_active(iter);
-    }
-    return true;
-  }
-  return false;
+    do {
+      int end = fill_span_end(iter, iter->cur);
+      if (n < max) {
+	runs[2*n] = iter->tx + iter->x_coords[iter->cur];
+	runs[2*n+1] = iter->tx + iter->x_coords[end];
+	clr[n++] = iter->fclr;
+      }
+      iter->cur = end+1;
+    } while (iter->cur < iter->n_active);
+    iter->y += 1;
+    poly_get_active(iter);
+  }
+  return n;
 };
 
-static void init_polyfill_iter(polygon_t *poly, poly_iter_t *iter) {
-  uint16_t mnx, mxx, mny, mxy;
+static void build_fill_table(polygon_t *poly) {
+  edge_table_t *tab = &(poly->fill_tab);
+
+  // at most one edge per segment
+  reserve_edges(tab, poly->n_pts>>1);
+  // all contours share one edge table so holes resolve in a single sweep
+  for (int k = 0; k < poly->n_contours; k++) {
+    int start = contour_start(poly, k);
+    tab->n_edges = fill_edges(0, poly->pts+start, contour_end(poly, k)-start, tab->edges, tab->n_edges);
+  }
+  sort_edges(tab->edges, tab->n_edges);
+  count_active(tab);
+  tab->valid = true;
+}
 
+static void init_polyfill_iter(polygon_t *poly, poly_iter_t *iter) {
   iter->base.nextLine = poly_next_line;
-  iter->base.nextRun = polyfill_next_run;
-  list_minmax(poly->pts, poly->n_pts, &mnx, &mxx, &mny, &mxy);
+  iter->base.lineRuns = polyfill_line_runs;
   iter->tx = (uint16_t)poly->tr.tx;
   iter->ty = (uint16_t)poly->tr.ty;
-  iter->y0 = mny;
-  iter->n_edges = mxy-mny+1;
-  iter->edges = (edge_t **)vgr2d_alloc(sizeof(edge_t *), iter->n_edges);
-  for (int i = 0; i < iter->n_edges; i++)
-    iter->edges[i] = NULL;
-  fill_edges(0, poly->pts, poly->n_pts, mny, iter->edges);
-  iter->idx = 0;
-  iter->n_active = 0;
-  iter->y = mny;
-  poly_get_active(iter);
+  poly_start(iter, &(poly->fill_tab));
   iter->width = poly->width;
   iter->fill = poly->fill;
   iter->stroke = poly->stroke;
   iter->fclr = poly->fclr;
   iter->sclr = poly->sclr;
+  iter->rule = poly->rule;
 }
 
+// The scratch holds one id per active edge, enough for every shape
 static int merge_spans(poly_iter_t *iter, int endpoint, uint16_t* x1, uint16_t *x2) {
   int i, j;
   int n_past=0;
-  uint16_t past_ids[MAX_ACTIVE];
-  int16_t past_x[MAX_ACTIVE];
+  uint16_t *past_ids = iter->past_ids;
+  int16_t *past_x = iter->past_x;
   int16_t x;
 
   for (i = iter->cur; i < iter->n_active; i++) {
@@ -294,122 +628,1577 @@ static int merge_spans(poly_iter_t *iter, int endpoint, uint16_t* x1, uint16_t *
   return endpoint;
 }
 
-static bool polystroke_next_run(void *arg, uint16_t yin, uint16_t* x1out, uint16_t *x2out, uint8_t* clr) {
+static int polystroke_line_runs(void *arg, uint16_t yin, uint16_t* runs, uint8_t* clr, int max) {
   uint16_t X1, X2;
+  int n = 0;
   poly_iter_t * iter = (poly_iter_t *)arg;
   uint16_t y = yin - iter->ty;
   
   if (y == iter->y && iter->cur < iter->n_active) {
-    int cur = iter->cur;
-    uint16_t id = iter->idmap[cur];
-    X1 = iter->x_coords[cur++];
-    if (iter->idmap[cur] != id) {
-      // overlapping span, need merge
-      // find current span
-      while (cur < iter->n_active && iter->idmap[cur] != id) cur++;
-      if (cur < iter->n_active) {
+    do {
+      int cur = iter->cur;
+      uint16_t id = iter->idmap[cur];
+      X1 = iter->x_coords[cur++];
+      X2 = X1;
+      if (cur == iter->n_active) {
+	// unpaired last crossing, only if the shape is degenerate
+	cur--;
+      } else if (iter->idmap[cur] != id) {
+	// overlapping span, need merge
+	// find current span
+	while (cur < iter->n_active && iter->idmap[cur] != id) cur++;
+	if (cur < iter->n_active) {
+	  X2 = iter->x_coords[cur];
+	  cur = merge_spans(iter, cur, &X1, &X2);
+	}
+      } else
 	X2 = iter->x_coords[cur];
-	cur = merge_spans(iter, cur, &X1, &X2);
+      printf("%d:(%d,%d)",y,X1,X2);
+      iter->cur = cur+1;
+      if (n < max) {
+	runs[2*n] = iter->tx + X1;
+	runs[2*n+1] = iter->tx + X2;
+	clr[n++] = iter->sclr;
       }
-    } else
-      X2 = iter->x_coords[cur];
-    printf("%d:(%d,%d)",y,X1,X2);
-    iter->cur = cur+1;
-    if (iter->cur >= iter->n_active) {
-      printf("\n");
-      iter->y += 1;
-      poly_get_active(iter);
-    }
-    *x1out = iter->tx + X1;
-    *x2out = iter->tx + X2;
-    *clr = iter->sclr;
-    return true;
+    } while (iter->cur < iter->n_active);
+    printf("\n");
+    iter->y += 1;
+    poly_get_active(iter);
   }
-  return false;
+  return n;
 };
 
-static void init_polystroke_iter(polygon_t *poly, poly_iter_t *iter) {
-  int i;
-  uint16_t xr, yr;
-  uint16_t mnx, mxx, mny, mxy;
-  int X1,Y1,X2,Y2,dx,dy;
+// Hexagon around the segment from X1,Y1 to X2,Y2 as edges of shape id
+static void stroke_segment(edge_table_t *tab, uint16_t id, int X1, int Y1, int X2, int Y2,
+			   uint16_t xr, uint16_t yr) {
   uint16_t pts[14];
+  int dx = X2-X1;
+  int dy = Y2-Y1;
+  if (dx < 0) {
+    int t;
+    t = X1; X1 = X2; X2 = t;
+    t = Y1; Y1 = Y2; Y2 = t;
+  }
+  if (SIGN(dx) == SIGN(dy)) {
+    // SE, NW swapped
+    pts[0] = X1+xr;
+    pts[1] = UDIFF(Y1,yr);
+    pts[2] = UDIFF(X1,xr);
+    pts[3] = pts[1];
+    pts[4] = pts[2];
+    pts[5] = Y1+yr;
+    pts[6] = UDIFF(X2,xr);
+    pts[7] = Y2+yr;
+    pts[8] = X2+xr;
+    pts[9] = pts[7];
+    pts[10] = pts[8];
+    pts[11] = UDIFF(Y2,yr);
+  } else {
+    // NE, SW swapped
+    pts[0] = UDIFF(X1, xr);
+    pts[1] = UDIFF(Y1, yr);
+    pts[2] = pts[0];
+    pts[3] = Y1+yr;
+    pts[4] = X1+xr;
+    pts[5] = pts[3];
+    pts[6] = X2+xr;
+    pts[7] = Y2+yr;
+    pts[8] = pts[6];
+    pts[9] = UDIFF(Y2, yr);
+    pts[10] = UDIFF(X2, xr);
+    pts[11] = pts[9];
+  }
+  pts[12] = pts[0];
+  pts[13] = pts[1];
+  tab->n_edges = fill_edges(id, pts, 14, tab->edges, tab->n_edges);
+}
+
+// Segment length in x units, measured in quarter pixels so the squares
+// stay within 32 bits
+static uint32_t segment_length(int dx, int dy) {
+  uint32_t qx = ABS(dx) >> 2;
+  uint32_t qy = ABS(dy) * (XSCALE/4);
+  return isqrt(qx*qx + qy*qy) << 2;
+}
+
+// Walks each contour through the dash pattern, restarting it at the
+// first point, and strokes the dashes into tab when given. A zero length
+// dash is a dot. Returns the number of dashes.
+static int stroke_dashes(polygon_t *poly, edge_table_t *tab, uint16_t xr, uint16_t yr) {
+  int i, k, d, n = 0;
+  uint32_t left;
+
+  for (k = 0; k < poly->n_contours; k++) {
+    d = 0;
+    left = poly->dash[0];
+    for (i = contour_start(poly, k)+2; i < contour_end(poly, k); i += 2) {
+      int X1 = poly->pts[i-2];
+      int Y1 = poly->pts[i-1];
+      int dx = poly->pts[i]-X1;
+      int dy = poly->pts[i+1]-Y1;
+      uint32_t len = segment_length(dx, dy);
+      uint32_t t = 0;
+      // the stroke extends this far past the ends of a piece, taken back
+      // off the ends of each dash so dashes and gaps keep their lengths
+      int64_t cap = (len > 0) ? ((int64_t)ABS(dx)*xr + (int64_t)ABS(dy)*XSCALE*yr)/len : 0;
+      while (t < len) {
+	uint32_t step = (left < len-t) ? left : len-t;
+	if ((d & 1) == 0) {
+	  // every dash gets its own id in the one table
+	  if (tab != NULL) {
+	    int64_t t1 = t, t2 = t+step;
+	    if (left == poly->dash[d])
+	      t1 += cap;
+	    if (step == left)
+	      t2 -= cap;
+	    if (t1 > t2)
+	      t1 = t2 = (t + t+step)/2;
+	    stroke_segment(tab, n, X1 + (int)(dx*t1/len), Y1 + (int)(dy*t1/len),
+			   X1 + (int)(dx*t2/len), Y1 + (int)(dy*t2/len), xr, yr);
+	  }
+	  n++;
+	}
+	t += step;
+	left -= step;
+	if (left == 0) {
+	  d = (d+1 < poly->n_dash) ? d+1 : 0;
+	  left = poly->dash[d];
+	}
+      }
+    }
+  }
+  return n;
+}
+
+static void build_stroke_table(polygon_t *poly) {
+  edge_table_t *tab = &(poly->stroke_tab);
+  int i, k;
+  uint16_t xr, yr;
 
-  iter->base.nextLine = poly_next_line;
-  iter->base.nextRun = polystroke_next_run;
   xr = (poly->width >= 3) ? XFX(poly->width)>>1 : XFX(3)>>1;
   yr = (poly->width >= 3) ? (YFX(poly->width)-1)>>1 : 1;
-  list_minmax(poly->pts, poly->n_pts, &mnx, &mxx, &mny, &mxy);
-  mny = (mny > yr) ? mny - yr : 0;
-  mxy += yr;
+  if (poly->n_dash > 0) {
+    // at most six edges per dash
+    reserve_edges(tab, 6*stroke_dashes(poly, NULL, xr, yr));
+    stroke_dashes(poly, tab, xr, yr);
+  } else {
+    // at most six edges per segment
+    reserve_edges(tab, 6*(poly->n_pts>>1));
+    // no segment joins one contour to the next
+    for (k = 0; k < poly->n_contours; k++) {
+      for (i = contour_start(poly, k)+2; i < contour_end(poly, k); i += 2)
+	stroke_segment(tab, i>>1, poly->pts[i-2], poly->pts[i-1], poly->pts[i], poly->pts[i+1], xr, yr);
+    }
+  }
+  sort_edges(tab->edges, tab->n_edges);
+  count_active(tab);
+  tab->valid = true;
+}
+
+static void init_polystroke_iter(polygon_t *poly, poly_iter_t *iter) {
+  iter->base.nextLine = poly_next_line;
+  iter->base.lineRuns = polystroke_line_runs;
   iter->tx = (uint16_t)poly->tr.tx;
   iter->ty = (uint16_t)poly->tr.ty;
-  iter->y0 = mny;
-  iter->n_edges = mxy-mny+1;
-  iter->edges = (edge_t **)vgr2d_alloc(sizeof(edge_t *), iter->n_edges);
-  for (i = 0; i < iter->n_edges; i++)
-    iter->edges[i] = NULL;
-  for (i = 2; i < poly->n_pts; i += 2) {
-    X1 = poly->pts[i-2];
-    Y1 = poly->pts[i-1];
-    X2 = poly->pts[i];
-    Y2 = poly->pts[i+1];
-    dx = X2-X1;
-    dy = Y2-Y1;
-    if (dx < 0) {
-      X2 = X1;
-      Y2 = Y1;
-      X1 = poly->pts[i];
-      Y1 = poly->pts[i+1];
-    }
-    if (SIGN(dx) == SIGN(dy)) {
-      // SE, NW swapped
-      pts[0] = X1+xr;
-      pts[1] = UDIFF(Y1,yr);
-      pts[2] = UDIFF(X1,xr);
-      pts[3] = pts[1];
-      pts[4] = pts[2];
-      pts[5] = Y1+yr;
-      pts[6] = UDIFF(X2,xr);
-      pts[7] = Y2+yr;
-      pts[8] = X2+xr;
-      pts[9] = pts[7];
-      pts[10] = pts[8];
-      pts[11] = UDIFF(Y2,yr);
-    } else {
-      // NE, SW swapped
-      pts[0] = UDIFF(X1, xr);
-      pts[1] = UDIFF(Y1, yr);
-      pts[2] = pts[0];
-      pts[3] = Y1+yr;
-      pts[4] = X1+xr;
-      pts[5] = pts[3];
-      pts[6] = X2+xr;
-      pts[7] = Y2+yr;
-      pts[8] = pts[6];
-      pts[9] = UDIFF(Y2, yr);
-      pts[10] = UDIFF(X2, xr);
-      pts[11] = pts[9];
-    }
-    pts[12] = pts[0];
-    pts[13] = pts[1];
-    fill_edges(i>>1, pts, 14, mny, iter->edges);
-  }
-  iter->idx = 0;
-  iter->n_active = 0;
-  iter->y = mny;
-  poly_get_active(iter);
+  poly_start(iter, &(poly->stroke_tab));
   iter->width = poly->width;
   iter->fill = poly->fill;
   iter->stroke = poly->stroke;
   iter->fclr = poly->fclr;
   iter->sclr = poly->sclr;
+  iter->rule = poly->rule;
+}
+
+// How far p is off the line through a and b, scaled by its length len so
+// points against one line compare without dividing. With a and b the same,
+// as at the ends of a closed contour, the distance from a.
+static int64_t point_offset(const uint16_t *a, const uint16_t *b, const uint16_t *p, uint32_t len) {
+  if (len == 0)
+    return segment_length(p[0]-a[0], p[1]-a[1]);
+  int64_t dx = b[0]-a[0];
+  int64_t dy = (int64_t)(b[1]-a[1])*XSCALE;
+  int64_t px = p[0]-a[0];
+  int64_t py = (int64_t)(p[1]-a[1])*XSCALE;
+  int64_t cross = dx*py - dy*px;
+  return (cross < 0) ? -cross : cross;
+}
+
+// Douglas-Peucker without recursion: the span up to the next kept point is
+// split at its farthest point until every point between is within tol,
+// then kept points are packed to the front. Returns the new length of pts.
+static int simplify_contour(uint16_t *pts, int n, uint16_t tol, uint8_t *keep) {
+  int np = n>>1;
+  int i, j, k;
+  if (np < 3)
+    return n;
+  memset(keep, 0, np);
+  keep[0] = keep[np-1] = 1;
+  i = 0;
+  while (i < np-1) {
+    for (j = i+1; !keep[j]; j++)
+      ;
+    uint32_t len = segment_length(pts[2*j]-pts[2*i], pts[2*j+1]-pts[2*i+1]);
+    int64_t best = (len > 0) ? (int64_t)tol*len : tol;
+    int far = 0;
+    for (k = i+1; k < j; k++) {
+      int64_t d = point_offset(pts+2*i, pts+2*j, pts+2*k, len);
+      if (d > best) {
+	best = d;
+	far = k;
+      }
+    }
+    if (far > 0)
+      keep[far] = 1;
+    else
+      i = j;
+  }
+  for (i = 0, j = 0; i < np; i++) {
+    if (keep[i]) {
+      pts[j++] = pts[2*i];
+      pts[j++] = pts[2*i+1];
+    }
+  }
+  return j;
+}
+
+// Drops the points of each contour that lie within tol of the outline
+// through the points kept and counts them in dropped
+void simplify_polygon(polygon_t *poly) {
+  int k, start, end, j, longest = 0;
+  poly->dropped = 0;
+  if (poly->tol == 0)
+    return;
+
+  for (k = 0, start = 0; k < poly->n_contours; k++, start = end) {
+    end = contour_end(poly, k);
+    if (end-start > longest)
+      longest = end-start;
+  }
+  // only allocated when a contour is longer than any before, so points
+  // can be reloaded every frame without allocating
+  if ((longest>>1) > poly->max_keep) {
+    if (poly->keep != NULL)
+      vgr2d_free(poly->keep, sizeof(uint8_t), poly->max_keep);
+    poly->keep = (uint8_t *)vgr2d_alloc(sizeof(uint8_t), longest>>1);
+    poly->max_keep = longest>>1;
+  }
+  for (k = 0, start = 0, j = 0; k < poly->n_contours; k++, start = end) {
+    end = contour_end(poly, k);
+    int n = simplify_contour(poly->pts+start, end-start, poly->tol, poly->keep);
+    memmove(poly->pts+j, poly->pts+start, n*sizeof(uint16_t));
+    j += n;
+    if (poly->n_contours > 1)
+      poly->ends[k] = j;
+  }
+  poly->dropped = (poly->n_pts-j)>>1;
+  poly->n_pts = j;
+  polygon_changed(poly);
+}
+
+// Builds the tables the polygon is drawn from, the stroke table standing
+// in when there is no fill as init_polygon_iter does
+void prepare_polygon(polygon_t *poly) {
+  if (poly->fill && !poly->fill_tab.valid)
+    build_fill_table(poly);
+  if ((poly->stroke || !poly->fill) && !poly->stroke_tab.valid)
+    build_stroke_table(poly);
 }
 
 void init_polygon_iter(polygon_t *poly, poly_iter_t *iter) {
   iter->base.size = sizeof(poly_iter_t);
+  iter->base.resolved = false;
   if (poly->fill)
     init_polyfill_iter(poly, iter);
   else
     init_polystroke_iter(poly, iter);
 }
+
+static bool outline_next_line(void *arg, uint16_t* y) {
+  outline_iter_t * iter = (outline_iter_t *)arg;
+  uint16_t yf, ys;
+  bool f = poly_next_line(&(iter->fill), &yf);
+  bool s = poly_next_line(&(iter->stroke), &ys);
+  if (f && s)
+    *y = (yf < ys) ? yf : ys;
+  else
+    *y = f ? yf : ys;
+  return f || s;
+}
+
+// A sweep gives at most one run per two active edges, or one more for an
+// unpaired last crossing
+static void reserve_outline(outline_iter_t *iter) {
+  int n = iter->fill.max_active;
+  if (iter->stroke.max_active > n)
+    n = iter->stroke.max_active;
+  n = (n+1)>>1;
+  if (n > iter->max_runs) {
+    iter->inner = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), 2*n);
+    iter->border = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), 2*n);
+    iter->iclr = (uint8_t *)vgr2d_alloc(sizeof(uint8_t), n);
+    iter->bclr = (uint8_t *)vgr2d_alloc(sizeof(uint8_t), n);
+    iter->max_runs = n;
+  }
+}
+
+static void outline_free_scratch(void *arg) {
+  outline_iter_t *iter = (outline_iter_t *)arg;
+  poly_free_scratch(&(iter->fill));
+  poly_free_scratch(&(iter->stroke));
+  if (iter->inner == iter->inner_buf)
+    return;
+  vgr2d_free(iter->inner, sizeof(uint16_t), 2*iter->max_runs);
+  vgr2d_free(iter->border, sizeof(uint16_t), 2*iter->max_runs);
+  vgr2d_free(iter->iclr, sizeof(uint8_t), iter->max_runs);
+  vgr2d_free(iter->bclr, sizeof(uint8_t), iter->max_runs);
+}
+
+static int outline_line_runs(void *arg, uint16_t y, uint16_t* runs, uint8_t* clr, int max) {
+  outline_iter_t * iter = (outline_iter_t *)arg;
+
+  // the active lists may have grown on the previous line
+  reserve_outline(iter);
+  int ni = polyfill_line_runs(&(iter->fill), y, iter->inner, iter->iclr, iter->max_runs);
+  int nb = polystroke_line_runs(&(iter->stroke), y, iter->border, iter->bclr, iter->max_runs);
+  // border pieces of neighboring segments may overlap
+  if (nb > 1)
+    nb = sort_runs(iter->border, iter->bclr, 2*nb)>>1;
+  return overlay_runs(iter->inner, iter->iclr, ni, iter->border, iter->bclr, nb, runs, clr, max);
+}
+
+void init_outline_iter(polygon_t *poly, outline_iter_t *iter) {
+  iter->base.size = sizeof(outline_iter_t);
+  iter->base.resolved = true;
+  iter->base.nextLine = outline_next_line;
+  iter->base.lineRuns = outline_line_runs;
+  iter->base.freeScratch = outline_free_scratch;
+  init_polyfill_iter(poly, &(iter->fill));
+  init_polystroke_iter(poly, &(iter->stroke));
+  iter->inner = iter->inner_buf;
+  iter->border = iter->border_buf;
+  iter->iclr = iter->iclr_buf;
+  iter->bclr = iter->bclr_buf;
+  iter->max_runs = MAX_ACTIVE/2;
+}
+
+
+//////////////////////////////////////// Instance
+
+void prepare_instance(instance_t *inst) {
+  prepare_polygon(inst->poly);
+}
+
+void init_instance_iter(instance_t *inst, poly_iter_t *iter) {
+  polygon_t *poly = inst->poly;
+
+  // the shape's edge table is shared, only placement and color differ
+  init_polygon_iter(poly, iter);
+  iter->tx = (uint16_t)inst->tr.tx;
+  iter->ty = (uint16_t)inst->tr.ty;
+  if (inst->recolor) {
+    if (poly->fill)
+      iter->fclr = inst->clr;
+    else
+      iter->sclr = inst->clr;
+  }
+}
+
+// an outlined shape recolors its interior
+void init_instance_outline_iter(instance_t *inst, outline_iter_t *iter) {
+  init_outline_iter(inst->poly, iter);
+  iter->fill.tx = iter->stroke.tx = (uint16_t)inst->tr.tx;
+  iter->fill.ty = iter->stroke.ty = (uint16_t)inst->tr.ty;
+  if (inst->recolor)
+    iter->fill.fclr = inst->clr;
+}
+
+
+//////////////////////////////////////// Path
+
+// Segments are appended to the edge table as they are flattened. The last
+// edge of a contour is only joined once the direction of the next one is
+// known, and the closing edge is joined with the first.
+typedef struct edge_builder_s {
+  edge_table_t *tab;
+  int sx, sy; // contour start
+  int px, py; // current point
+  int first_wind;
+  edge_t *last;
+} edge_builder_t;
+
+static void builder_line(edge_builder_t *b, int x, int y) {
+  if (y != b->py) {
+    edge_t *e = &(b->tab->edges[b->tab->n_edges++]);
+    edge_set(e, 0, b->px, b->py, x, y);
+    if (b->last != NULL)
+      edge_join(b->last, e->wind);
+    else
+      b->first_wind = e->wind;
+    b->last = e;
+  }
+  b->px = x;
+  b->py = y;
+}
+
+static void builder_close(edge_builder_t *b) {
+  builder_line(b, b->sx, b->sy);
+  if (b->last != NULL)
+    edge_join(b->last, b->first_wind);
+  b->last = NULL;
+}
+
+static void builder_move(edge_builder_t *b, int x, int y) {
+  builder_close(b);
+  b->sx = b->px = x;
+  b->sy = b->py = y;
+}
+
+// Length of the second difference p0-2*p1+p2, y scaled to x units so the
+// tolerance is the same in both directions. Manhattan overestimates, which
+// only errs towards more segments.
+static uint32_t second_diff(const uint16_t *p0, const uint16_t *p1, const uint16_t *p2) {
+  int dx = p0[0] - 2*p1[0] + p2[0];
+  int dy = p0[1] - 2*p1[1] + p2[1];
+  return ABS(dx) + ABS(dy) * (XSCALE / YSCALE);
+}
+
+// A curve with second difference d strays from its chords by at most
+// d/(4n^2) for a quad and 3d/(4n^2) for a cubic with n uniform segments
+static int curve_segments(uint32_t d) {
+  uint32_t n = isqrt(d / (4*PATH_TOL)) + 1;
+  return (n > PATH_MAX_SEGS) ? PATH_MAX_SEGS : n;
+}
+
+static int quad_segments(const uint16_t *p) {
+  return curve_segments(second_diff(p, p+2, p+4));
+}
+
+static int cubic_segments(const uint16_t *p) {
+  uint32_t d1 = second_diff(p, p+2, p+4);
+  uint32_t d2 = second_diff(p+2, p+4, p+6);
+  return curve_segments(3 * ((d1 > d2) ? d1 : d2));
+}
+
+// p holds the current point followed by the control and end points
+static void flatten_quad(edge_builder_t *b, const uint16_t *p) {
+  int n = quad_segments(p);
+  int32_t den = n*n;
+  for (int i = 1; i <= n; i++) {
+    int32_t w0 = (n-i)*(n-i), w1 = 2*i*(n-i), w2 = i*i;
+    int x = (w0*p[0] + w1*p[2] + w2*p[4] + den/2) / den;
+    int y = (w0*p[1] + w1*p[3] + w2*p[5] + den/2) / den;
+    builder_line(b, x, y);
+  }
+}
+
+static void flatten_cubic(edge_builder_t *b, const uint16_t *p) {
+  int n = cubic_segments(p);
+  int64_t den = n*n*n;
+  for (int i = 1; i <= n; i++) {
+    int64_t u = n-i;
+    int64_t w0 = u*u*u, w1 = 3*u*u*i, w2 = 3*u*i*i, w3 = (int64_t)i*i*i;
+    int x = (w0*p[0] + w1*p[2] + w2*p[4] + w3*p[6] + den/2) / den;
+    int y = (w0*p[1] + w1*p[3] + w2*p[5] + w3*p[7] + den/2) / den;
+    builder_line(b, x, y);
+  }
+}
+
+int path_cmd_points(uint8_t cmd) {
+  switch (cmd) {
+  case PATH_MOVE:
+  case PATH_LINE:
+    return 1;
+  case PATH_QUAD:
+    return 2;
+  case PATH_CUBIC:
+    return 3;
+  }
+  return 0;
+}
+
+void init_path(path_t *path) {
+  init_transform(&(path->tr));
+  path->fclr = 0;
+  path->rule = RULE_EVENODD;
+  path->cmds = NULL;
+  path->pts = NULL;
+  path->n_cmds = 0;
+  path->n_pts = 0;
+  path->max_cmds = 0;
+  path->max_pts = 0;
+  init_edge_table(&(path->fill_tab));
+}
+
+void path_changed(path_t *path) {
+  path->fill_tab.valid = false;
+}
+
+// Commands are walked twice, first to size the table from the segment
+// counts and then to flatten. The current point is kept in cur so a curve
+// has its start and controls contiguous.
+static void build_path_table(path_t *path) {
+  edge_table_t *tab = &(path->fill_tab);
+  int n = 0, j = 0;
+  uint16_t cur[8] = {0}, start[2] = {0};
+
+  for (int i = 0; i < path->n_cmds; i++) {
+    uint8_t cmd = path->cmds[i];
+    int np = path_cmd_points(cmd);
+    memcpy(cur+2, path->pts+j, np*2*sizeof(uint16_t));
+    if (cmd == PATH_QUAD)
+      n += quad_segments(cur);
+    else if (cmd == PATH_CUBIC)
+      n += cubic_segments(cur);
+    else
+      n++; // a move closes the previous contour
+    j += 2*np;
+    if (cmd == PATH_MOVE)
+      memcpy(start, cur+2, sizeof(start));
+    if (cmd == PATH_CLOSE)
+      memcpy(cur, start, sizeof(start));
+    else
+      memcpy(cur, cur+2*np, sizeof(start));
+  }
+  reserve_edges(tab, n+1);
+
+  edge_builder_t b;
+  b.tab = tab;
+  b.sx = b.sy = b.px = b.py = 0;
+  b.last = NULL;
+  j = 0;
+  for (int i = 0; i < path->n_cmds; i++) {
+    uint8_t cmd = path->cmds[i];
+    const uint16_t *p = path->pts+j;
+    int np = path_cmd_points(cmd);
+    cur[0] = b.px;
+    cur[1] = b.py;
+    memcpy(cur+2, p, np*2*sizeof(uint16_t));
+    switch (cmd) {
+    case PATH_MOVE:
+      builder_move(&b, p[0], p[1]);
+      break;
+    case PATH_LINE:
+      builder_line(&b, p[0], p[1]);
+      break;
+    case PATH_QUAD:
+      flatten_quad(&b, cur);
+      break;
+    case PATH_CUBIC:
+      flatten_cubic(&b, cur);
+      break;
+    case PATH_CLOSE:
+      builder_close(&b);
+      break;
+    }
+    j += 2*np;
+  }
+  builder_close(&b); // fills are always closed
+  sort_edges(tab->edges, tab->n_edges);
+  count_active(tab);
+  tab->valid = true;
+}
+
+void prepare_path(path_t *path) {
+  if (!path->fill_tab.valid)
+    build_path_table(path);
+}
+
+void init_path_iter(path_t *path, poly_iter_t *iter) {
+  iter->base.size = sizeof(poly_iter_t);
+  iter->base.resolved = false;
+  iter->base.nextLine = poly_next_line;
+  iter->base.lineRuns = polyfill_line_runs;
+  iter->tx = (uint16_t)path->tr.tx;
+  iter->ty = (uint16_t)path->tr.ty;
+  poly_start(iter, &(path->fill_tab));
+  iter->width = 1;
+  iter->fill = true;
+  iter->stroke = false;
+  iter->fclr = path->fclr;
+  iter->sclr = path->fclr;
+  iter->rule = path->rule;
+}
+
+
+//////////////////////////////////////// Trace
+
+// Rows covered above and below a sample, width rows in total
+#define TRACE_UP(t) (((t)->width-1)>>1)
+#define TRACE_DOWN(t) ((t)->width>>1)
+
+static int trace_segments(trace_t *trace) {
+  return (trace->n_samples > 1) ? trace->n_samples-1 : 0;
+}
+
+static uint16_t seg_top(trace_t *trace, int i) {
+  uint16_t a = trace->samples[i], b = trace->samples[i+1];
+  return UDIFF((a < b) ? a : b, TRACE_UP(trace));
+}
+
+static uint16_t seg_bot(trace_t *trace, int i) {
+  uint16_t a = trace->samples[i], b = trace->samples[i+1];
+  return ((a > b) ? a : b) + TRACE_DOWN(trace);
+}
+
+static void sort_trace_order(trace_t *trace) {
+  int n = trace_segments(trace);
+  int gap, i, j;
+  uint16_t s;
+
+  for (i = 0; i < n; i++)
+    trace->order[i] = i;
+  for (gap = 1; gap < n/3; gap = 3*gap+1);
+  for (; gap > 0; gap /= 3) {
+    for (i = gap; i < n; i++) {
+      s = trace->order[i];
+      for (j = i; j >= gap && seg_top(trace, trace->order[j-gap]) > seg_top(trace, s); j -= gap)
+	trace->order[j] = trace->order[j-gap];
+      trace->order[j] = s;
+    }
+  }
+  trace->sorted = true;
+}
+
+static void trace_advance(trace_iter_t *iter, uint16_t curY) {
+  trace_t *trace = iter->trace;
+  int n = trace_segments(trace);
+  int i, j, k;
+  uint16_t s;
+
+  // filter out finished segments
+  for (i = 0, j = 0; i < iter->n_active; i++) {
+    s = iter->active[i];
+    if (seg_bot(trace, s) >= curY)
+      iter->active[j++] = s;
+  }
+
+  do {
+    // push segments starting, keeping the active set in x order
+    while (iter->idx < n && seg_top(trace, trace->order[iter->idx]) <= curY) {
+      s = trace->order[iter->idx++];
+      for (k = j; k > 0 && iter->active[k-1] > s; k--)
+	iter->active[k] = iter->active[k-1];
+      iter->active[k] = s;
+      j++;
+    }
+    // gap between segments, jump to the next one
+    if (j == 0 && iter->idx < n)
+      curY = seg_top(trace, trace->order[iter->idx]);
+    else
+      break;
+  } while (true);
+  iter->n_active = j;
+  iter->y = curY;
+}
+
+static bool trace_next_line(void *arg, uint16_t* y) {
+  trace_iter_t * iter = (trace_iter_t *)arg;
+  *y = iter->ty + iter->y;
+  return (iter->n_active > 0);
+}
+
+// Each active segment covers the x range where it passes within the trace
+// width of the line, padded by half the width so steep segments stay
+// visible. Segments are in x order so overlapping ranges merge in one pass.
+static int trace_line_runs(void *arg, uint16_t yin, uint16_t* runs, uint8_t* clr, int max) {
+  trace_iter_t * iter = (trace_iter_t *)arg;
+  trace_t *trace = iter->trace;
+  uint16_t y = yin - iter->ty;
+  int32_t pad = XFX(trace->width)>>1;
+  int32_t ylo = (int32_t)y - TRACE_DOWN(trace);
+  int32_t yhi = (int32_t)y + TRACE_UP(trace);
+  int i, n = 0;
+
+  if (y == iter->y && iter->n_active > 0) {
+    for (i = 0; i < iter->n_active; i++) {
+      uint16_t s = iter->active[i];
+      int32_t a = trace->samples[s], b = trace->samples[s+1];
+      int32_t x = (int32_t)s*trace->dx;
+      int32_t x1 = x, x2 = x+trace->dx;
+      if (a != b) {
+	int32_t t1 = x + (ylo-a)*trace->dx/(b-a);
+	int32_t t2 = x + (yhi-a)*trace->dx/(b-a);
+	if (t1 > t2) {
+	  int32_t t = t1;
+	  t1 = t2;
+	  t2 = t;
+	}
+	if (t1 > x1) x1 = t1;
+	if (t2 < x2) x2 = t2;
+      }
+      x1 = iter->tx + ((x1 > pad) ? x1-pad : 0);
+      x2 = iter->tx + x2 + pad;
+      // ranges less than a pixel apart are joined so the trace stays solid
+      if (n > 0 && x1 <= runs[2*n-1]+XFX(1)) {
+	if (x1 < runs[2*n-2]) runs[2*n-2] = x1;
+	if (x2 > runs[2*n-1]) runs[2*n-1] = x2;
+      } else if (n < max) {
+	runs[2*n] = x1;
+	runs[2*n+1] = x2;
+	clr[n++] = trace->clr;
+      }
+    }
+    trace_advance(iter, y+1);
+  }
+  return n;
+}
+
+// Must be called whenever the samples or width of a trace change
+void trace_changed(trace_t *trace) {
+  trace->sorted = false;
+}
+
+void prepare_trace(trace_t *trace) {
+  if (!trace->sorted)
+    sort_trace_order(trace);
+}
+
+static void trace_free_scratch(void *arg) {
+  trace_iter_t *iter = (trace_iter_t *)arg;
+  vgr2d_free(iter->active, sizeof(uint16_t), iter->max_active);
+}
+
+void init_trace_iter(trace_t *trace, trace_iter_t *iter) {
+  iter->base.size = sizeof(trace_iter_t);
+  iter->base.resolved = false;
+  iter->base.nextLine = trace_next_line;
+  iter->base.lineRuns = trace_line_runs;
+  iter->base.freeScratch = trace_free_scratch;
+  iter->trace = trace;
+  iter->active = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), trace_segments(trace));
+  iter->max_active = trace_segments(trace);
+  iter->n_active = 0;
+  iter->idx = 0;
+  iter->tx = (uint16_t)trace->tr.tx;
+  iter->ty = (uint16_t)trace->tr.ty;
+  trace_advance(iter, (trace_segments(trace) > 0) ? seg_top(trace, trace->order[0]) : 0);
+}
+
+
+//////////////////////////////////////// Scan
+
+static int sort_runs(uint16_t *runs, uint8_t *clr, int nx) {
+  int n = nx>>1;
+  uint8_t c;
+  uint16_t x1, x2;
+
+  bool swapped = true;
+  for (int i = 0; i < n && swapped; i++) {
+    // runs mostly arrive in x order, stop once a pass makes no swap
+    swapped = false;
+    for (int j = n-1; j > i; j--) {
+      int ri = j<<1;
+      if (runs[ri-2] > runs[ri]) {
+	swapped = true;
+	c = clr[j-1];
+	x1 = runs[ri-2];
+	x2 = runs[ri-1];
+	runs[ri-2] = runs[ri];
+	runs[ri-1] = runs[ri+1];
+	clr[j-1] = clr[j];
+	runs[ri] = x1;
+	runs[ri+1] = x2;
+	clr[j] = c;
+      }
+    }
+  }
+
+  int oc = 1;
+  int oi = 2;
+  int ri = 2;
+  for (int i = 1; i < n; i++) {
+    if (runs[ri] >= runs[oi-1]) {
+      uint16_t dx = runs[ri]-runs[oi-1];
+      // dx 0 is okay, otherwise must meet minimum
+      if (dx != 0) {
+	if (XFX_INT(runs[ri]) == (XFX_INT(runs[oi-1])+1)) {
+	  runs[oi-1] = XFX(XFX_INT(runs[ri]));
+	  runs[ri] = runs[oi-1];
+	} else if (dx < MIN_DX) {
+	  // if < 1 pix and not consecutive x pos the x is same
+	  runs[ri] = runs[oi-1];
+	}
+      }
+    } else {
+      // overlapped
+      runs[ri] = runs[oi-1]; // make abutted
+    }
+    if (runs[ri] < runs[ri+1]) { // not negative run
+      if (runs[oi-1] == runs[ri] && clr[i] == clr[oc-1]) {
+	// abutted, same color can be merged
+	runs[oi-1] = runs[ri+1]; // extend previous, and discard current
+      } else if ((runs[ri+1]-runs[ri]) >= MIN_DX) { // has minimum width
+	if (ri != oi) {
+	  runs[oi] = runs[ri];
+	  runs[oi+1] = runs[ri+1];
+	  clr[oc] = clr[i];
+	}
+	oi += 2;
+	oc += 1;
+      }
+    }
+    ri += 2;
+  }
+  if (oi == 2 && ((runs[1]-runs[0]) < MIN_DX))
+    return 0;
+  return oi;
+}
+
+static uint16_t split_span(uint16_t n, uint16_t sz0, uint16_t sz1) {
+  uint16_t m = n - sz0;
+  while (m>sz1) m -= sz1;
+  return (m<MIN_DX) ? (sz0 - (XFX(1)-m)) : sz0;
+}
+
+// Cuts the runs of top out of base and merges both in x order, both inputs
+// sorted without overlaps. Returns the number of runs written to out.
+static int overlay_runs(uint16_t *base, uint8_t *bclr, int nb,
+			uint16_t *top, uint8_t *tclr, int nt,
+			uint16_t *out, uint8_t *oclr, int max) {
+  int i = 0, j = 0, n = 0;
+  uint16_t b1 = 0, b2 = 0, covered = 0;
+  uint8_t bc = 0;
+  bool have = false;
+
+  while (n < max) {
+    // next base run, minus what the last top run covers
+    while (!have && i < nb) {
+      b1 = (base[2*i] > covered) ? base[2*i] : covered;
+      b2 = base[2*i+1];
+      bc = bclr[i++];
+      have = (b1 < b2);
+    }
+    if (j < nt && (!have || top[2*j] <= b1)) {
+      out[2*n] = top[2*j];
+      out[2*n+1] = top[2*j+1];
+      oclr[n++] = tclr[j];
+      covered = top[2*j+1];
+      if (have && b1 < covered) {
+	b1 = covered;
+	have = (b1 < b2);
+      }
+      j++;
+    } else if (have) {
+      // base piece up to the next top run
+      uint16_t e = (j < nt && top[2*j] < b2) ? top[2*j] : b2;
+      out[2*n] = b1;
+      out[2*n+1] = e;
+      oclr[n++] = bc;
+      if (e == b2)
+	have = false;
+      else
+	b1 = e;
+    } else
+      break;
+  }
+  return n;
+}
+
+// Keeps the runs inside the frame, returns the new run count
+static int clip_runs(uint16_t *runs, uint8_t *clr, int n, int xres) {
+  int k, ri = 0;
+  uint16_t x1, x2;
+  for (k = 0; k < 2*n; k += 2) {
+    x1 = runs[k];
+    x2 = runs[k+1];
+    if (x2 > x1 && x1 < xres) {
+      if (x2 >= xres) x2 = xres-1;
+      clr[ri>>1] = clr[k>>1];
+      runs[ri++] = x1;
+      runs[ri++] = x2;
+    }
+  }
+  return ri>>1;
+}
+
+void init_scan(scan_t *scan, iter_base_t **iters, int n_iters, int xres, int yres, uint16_t *runs, uint8_t *clr, int max_runs) {
+  scan->iters = iters;
+  scan->n_iters = n_iters;
+  scan->xres = xres;
+  scan->yres = yres;
+  scan->runs = runs;
+  scan->clr = clr;
+  scan->max_runs = max_runs;
+  scan->release = NULL;
+}
+
+// Frees what an iterator allocated for its sweep, once
+void free_iter_scratch(iter_base_t *iter) {
+  if (iter->freeScratch != NULL) {
+    iter->freeScratch(iter);
+    iter->freeScratch = NULL;
+  }
+}
+
+// Frees the scratch of the iterators a scan left unfinished, their
+// structs stay with the caller
+void end_scan(scan_t *scan) {
+  for (int i = 0; i < scan->n_iters; i++) {
+    if (scan->iters[i] != NULL)
+      free_iter_scratch(scan->iters[i]);
+  }
+}
+
+// Resolves the next line having runs and passes it to the sink, returns
+// false once every iterator is done or past the bottom of the frame
+bool scan_line(scan_t *scan, span_sink_t *sink) {
+  iter_base_t **iters = scan->iters;
+  // the work area holds the runs of one object, the line resolved so far
+  // and the overlay result
+  int max = scan->max_runs;
+  uint16_t *runs = scan->runs, *line = runs + 2*max, *out = runs + 4*max;
+  uint8_t *clr = scan->clr, *lclr = clr + max, *oclr = clr + 2*max;
+  uint16_t curY, y;
+  int i, n, nl;
+
+  do {
+    // find next closest line
+    curY = 0xffff;
+    for (i = 0; i < scan->n_iters; i++) {
+      if (iters[i] != NULL) {
+	if (iters[i]->nextLine(iters[i], &y)) {
+	  if (y < curY)
+	    curY = y;
+	} else {
+	  free_iter_scratch(iters[i]);
+	  if (scan->release != NULL)
+	    scan->release(iters[i]);
+	  iters[i] = NULL;
+	}
+      }
+    }
+    if (curY == 0xffff || curY >= scan->yres)
+      return false;
+
+    // paint the objects in list order, each one covering those before it
+    nl = 0;
+    for (i = 0; i < scan->n_iters; i++) {
+      if (iters[i] == NULL)
+	continue;
+      n = iters[i]->lineRuns(iters[i], curY, runs, clr, max);
+      n = clip_runs(runs, clr, n, scan->xres);
+      if (n > 0 && !iters[i]->resolved)
+	n = sort_runs(runs, clr, 2*n)>>1;
+      if (n == 0)
+	continue;
+      if (nl == 0 || runs[0] >= line[2*nl-1]) {
+	// nothing to cover, append
+	if (n > max-nl)
+	  n = max-nl;
+	memcpy(&line[2*nl], runs, 2*n*sizeof(uint16_t));
+	memcpy(&lclr[nl], clr, n);
+	nl += n;
+      } else {
+	nl = overlay_runs(line, lclr, nl, runs, clr, n, out, oclr, max);
+	uint16_t *t = line; line = out; out = t;
+	uint8_t *tc = lclr; lclr = oclr; oclr = tc;
+      }
+    }
+
+    // pieces left by the overlay may need the minimum widths restored
+    if (nl > 0)
+      nl = sort_runs(line, lclr, 2*nl)>>1;
+  } while (nl == 0);
+
+  sink->line(sink, curY, line, lclr, nl);
+  return true;
+}
+
+
+//////////////////////////////////////// Layer
+
+void init_layer(layer_t *layer, int height) {
+  layer->height = height;
+  layer->start = (uint32_t *)vgr2d_alloc(sizeof(uint32_t), height+1);
+  for (int y = 0; y <= height; y++)
+    layer->start[y] = 0;
+  layer->runs = NULL;
+  layer->clr = NULL;
+  layer->n_runs = 0;
+}
+
+// Before layer_counted() only the runs of each line are counted, after
+// it they are stored. Each line arrives once so start[y] is its slot.
+static void layer_line(span_sink_t *sink, uint16_t y, uint16_t *runs, uint8_t *clr, int n) {
+  layer_t *layer = ((layer_sink_t *)sink)->layer;
+  if (y >= layer->height)
+    return;
+  if (layer->runs == NULL) {
+    layer->start[y+1] = n;
+  } else {
+    uint32_t k = layer->start[y];
+    for (int i = 0; i < n; i++) {
+      layer->runs[2*(k+i)] = runs[2*i];
+      layer->runs[2*(k+i)+1] = runs[2*i+1];
+      layer->clr[k+i] = clr[i];
+    }
+  }
+}
+
+void init_layer_sink(layer_sink_t *sink, layer_t *layer) {
+  sink->base.line = layer_line;
+  sink->layer = layer;
+}
+
+void layer_counted(layer_t *layer) {
+  for (int y = 0; y < layer->height; y++)
+    layer->start[y+1] += layer->start[y];
+  layer->n_runs = layer->start[layer->height];
+  layer->runs = (uint16_t *)vgr2d_alloc(sizeof(uint16_t), 2*layer->n_runs+1);
+  layer->clr = (uint8_t *)vgr2d_alloc(sizeof(uint8_t), layer->n_runs+1);
+}
+
+static void layer_skip(layer_iter_t *iter) {
+  layer_t *layer = iter->layer;
+  while (iter->y < layer->height && layer->start[iter->y] == layer->start[iter->y+1])
+    iter->y++;
+}
+
+static bool layer_next_line(void *arg, uint16_t* y) {
+  layer_iter_t * iter = (layer_iter_t *)arg;
+  *y = iter->y;
+  return (iter->y < iter->layer->height);
+}
+
+static int layer_line_runs(void *arg, uint16_t y, uint16_t* runs, uint8_t* clr, int max) {
+  layer_iter_t * iter = (layer_iter_t *)arg;
+  layer_t *layer = iter->layer;
+  int n = 0;
+
+  if (y == iter->y && iter->y < layer->height) {
+    uint32_t k = layer->start[y];
+    for (n = 0; k < layer->start[y+1] && n < max; k++, n++) {
+      runs[2*n] = layer->runs[2*k];
+      runs[2*n+1] = layer->runs[2*k+1];
+      clr[n] = layer->clr[k];
+    }
+    iter->y++;
+    layer_skip(iter);
+  }
+  return n;
+}
+
+void init_layer_iter(layer_t *layer, layer_iter_t *iter) {
+  iter->base.size = sizeof(layer_iter_t);
+  iter->base.resolved = true;
+  iter->base.nextLine = layer_next_line;
+  iter->base.lineRuns = layer_line_runs;
+  iter->base.freeScratch = NULL;
+  iter->layer = layer;
+  iter->y = 0;
+  layer_skip(iter);
+}
+
+
+//////////////////////////////////////// Encoder
+
+// Commands needed to skip dx or fill s, split as encode_line does
+static int gap_cmds(uint16_t dx) {
+  int n = 0;
+  if (dx > MAX_DX) {
+    dx -= split_span(dx, MAX_DX, MAX_DX);
+    n++;
+  }
+  return n + (dx + MAX_DX - 1) / MAX_DX;
+}
+
+static int span_cmds(uint16_t s) {
+  if (s > MAX_CLRX)
+    s -= split_span(s, MAX_CLRX, MAX_SPANX);
+  else
+    s = 0;
+  return 1 + (s + MAX_SPANX - 1) / MAX_SPANX;
+}
+
+static size_t line_bytes(encoder_t *enc, uint16_t curY, uint16_t *runs, int n) {
+  uint16_t dx, s, curX = 0;
+  int cmds = 0;
+
+  if (curY > 0) {
+    cmds++;
+    if (curY == (enc->prevY+1) && runs[0] <= MAX_NLX)
+      curX = runs[0];
+  }
+  for (int i = 0; i < 2*n; i += 2) {
+    s = runs[i+1] - runs[i];
+    if (s < MIN_DX)
+      continue;
+    dx = runs[i] - curX;
+    if (curY == 0 && curX == 0 && dx < MIN_DX) {
+      if (runs[i+1] < 2*MIN_DX)
+	continue;
+      dx = MIN_DX;
+      s = runs[i+1] - MIN_DX;
+    }
+    cmds += gap_cmds(dx) + span_cmds(s);
+    curX = runs[i+1];
+  }
+  return 2*cmds;
+}
+
+// Simplifies a line until it fits the budget, one smallest change at a
+// time: the narrowest gap is closed by joining its two runs in the color
+// of the wider one, unless a sub-pixel sliver narrower than that gap can
+// be dropped. The last run is always kept, a budget of at least
+// min_line_budget() fits it.
+static int fit_line(encoder_t *enc, uint16_t curY, uint16_t *runs, uint8_t *clr, int n) {
+  while (n > 1 && line_bytes(enc, curY, runs, n) > enc->budget) {
+    uint16_t gap = 0xffff, w = 0xffff;
+    int gi = 0, wi = 0;
+    for (int i = 0; i < n; i++) {
+      if (runs[2*i+1] - runs[2*i] < w) {
+	w = runs[2*i+1] - runs[2*i];
+	wi = i;
+      }
+      if (i > 0 && runs[2*i] - runs[2*i-1] < gap) {
+	gap = runs[2*i] - runs[2*i-1];
+	gi = i;
+      }
+    }
+    if (w < XFX(1) && w < gap) {
+      gi = wi; // removed below
+    } else {
+      if (runs[2*gi+1] - runs[2*gi] > runs[2*gi-1] - runs[2*gi-2])
+	clr[gi-1] = clr[gi];
+      runs[2*gi-1] = runs[2*gi+1];
+    }
+    n--;
+    memmove(runs+2*gi, runs+2*gi+2, (n-gi)*2*sizeof(uint16_t));
+    memmove(clr+gi, clr+gi+1, n-gi);
+  }
+  return n;
+}
+
+static void encode_line(span_sink_t *sink, uint16_t curY, uint16_t *runs, uint8_t *clr, int n) {
+  encoder_t *enc = (encoder_t *)sink;
+
+  if (enc->budget > 0 && line_bytes(enc, curY, runs, n) > enc->budget) {
+    enc->degraded++;
+    n = fit_line(enc, curY, runs, clr, n);
+  }
+
+  uint8_t *buf = enc->buf;
+  size_t bufpos = enc->bufpos;
+  int ri = n<<1;
+  uint16_t cmd;
+  uint16_t x1, dx, dx0, s, s0, curX;
+  int i;
+
+  // room for the line command and the frame terminator
+  if (bufpos + 2 + 2 > enc->buflen) {
+    enc->emit(enc->user, buf, bufpos);
+    bufpos = 0;
+  }
+#if 0
+  printf("%d>",curY);
+  for (i = 0; i < ri; i+=2)
+    printf("(%f,%f)",runs[i]/16.0,runs[i+1]/16.0);
+  printf("\n");
+#endif
+  x1 = runs[0];
+  if (curY > 0) {
+    if (curY == (enc->prevY+1) && x1 <= MAX_NLX) {
+      cmd = 0xa000|x1;
+      curX = x1;
+    } else {
+      cmd = 0xf000|curY;
+      curX = 0;
+    }
+    buf[bufpos++] = cmd>>8;
+    buf[bufpos++] = cmd&0xff;
+  } else
+    curX = 0;
+  for (i = 0; i < ri; i+=2) {
+    s = runs[i+1] - runs[i];
+    if (s < MIN_DX)
+      continue;
+
+    dx = runs[i] - curX;
+    if (curY == 0 && curX == 0 && dx < MIN_DX) {
+      // top-left corner special case
+      if (runs[i+1] < 2*MIN_DX)
+	continue; // below minimum span
+      dx = MIN_DX;
+      s = runs[i+1] - MIN_DX;
+    }
+    if (dx > 0 && dx < MIN_DX) {
+      printf("ERR");
+      for (int k = 0; k < ri; k+=2)
+	printf(" %d,%d",runs[k],runs[k+1]);
+      printf("\n");
+    }
+    // a line can hold more runs than the buffer, so room is made a run
+    // at a time
+    if (bufpos + 2*(gap_cmds(dx) + span_cmds(s)) + 2 > enc->buflen) {
+      enc->emit(enc->user, buf, bufpos);
+      bufpos = 0;
+    }
+    if (dx > MAX_DX) {
+      dx0 = split_span(dx, MAX_DX, MAX_DX);
+      cmd = 0x8000|dx0;
+      buf[bufpos++] = cmd>>8;
+      buf[bufpos++] = cmd&0xff;
+      dx -= dx0;
+    }
+    while (dx > MAX_DX) {
+      cmd = 0x8000|MAX_DX;
+      buf[bufpos++] = cmd>>8;
+      buf[bufpos++] = cmd&0xff;
+      dx -= MAX_DX;
+    }
+    if (dx > 0) {
+      cmd = 0x8000|dx;
+      buf[bufpos++] = cmd>>8;
+      buf[bufpos++] = cmd&0xff;
+    }
+
+    if (s > MAX_CLRX) {
+      s0 = split_span(s, MAX_CLRX, MAX_SPANX);
+      cmd = (((uint16_t)clr[i>>1])<<8)|s0;
+      s -= s0;
+    } else {
+      cmd = (((uint16_t)clr[i>>1])<<8)|s;
+      s = 0;
+    }
+    buf[bufpos++] = cmd>>8;
+    buf[bufpos++] = cmd&0xff;
+    while (s > MAX_SPANX) {
+      cmd = 0xc000|MAX_SPANX;
+      buf[bufpos++] = cmd>>8;
+      buf[bufpos++] = cmd&0xff;
+      s -= MAX_SPANX;
+    }
+    if (s > 0) {
+      cmd = 0xc000|s;
+      buf[bufpos++] = cmd>>8;
+      buf[bufpos++] = cmd&0xff;
+    }
+
+    curX = runs[i+1];
+  }
+  enc->prevY = curY;
+  enc->bufpos = bufpos;
+}
+
+// Bytes of the longest line of one run at xres: the line command, then a
+// gap and a span each split into as many commands as they can need
+size_t min_line_budget(uint16_t xres) {
+  int gap = 2 + xres / MAX_DX;
+  int span = 2 + xres / MAX_SPANX;
+  return 2*(1 + gap + span);
+}
+
+void init_encoder(encoder_t *enc, uint8_t *buf, size_t buflen, emit_t emit, void *user) {
+  enc->base.line = encode_line;
+  enc->buf = buf;
+  enc->buflen = buflen;
+  enc->bufpos = 0;
+  enc->prevY = 0xffff;
+  enc->budget = 0;
+  enc->degraded = 0;
+  enc->emit = emit;
+  enc->user = user;
+}
+
+
+//////////////////////////////////////// Framebuffer
+
+// A pixel is covered when its center falls inside the run, so both run
+// ends round to the nearest pixel boundary
+static void framebuffer_line(span_sink_t *sink, uint16_t y, uint16_t *runs, uint8_t *clr, int n) {
+  framebuffer_t *fb = (framebuffer_t *)sink;
+  if (y >= fb->height)
+    return;
+  uint8_t *row = fb->pixels + y*fb->width;
+  for (int i = 0; i < n; i++) {
+    int p1 = XFX_INT(runs[2*i]+(XFX(1)>>1)-1);
+    int p2 = XFX_INT(runs[2*i+1]+(XFX(1)>>1)-1);
+    if (p2 > fb->width)
+      p2 = fb->width;
+    if (p2 > p1)
+      memset(row+p1, clr[i], p2-p1);
+  }
+}
+
+void init_framebuffer(framebuffer_t *fb, uint8_t *pixels, int width, int height) {
+  fb->base.line = framebuffer_line;
+  fb->pixels = pixels;
+  fb->width = width;
+  fb->height = height;
+}
+
+
+//////////////////////////////////////// Context
+
+// The caller sets release, emit, user and budget as needed
+void init_ctx(vgr2d_ctx_t *ctx, int xres, int yres, uint16_t *runs, uint8_t *clr, int max_runs, uint8_t *buf, size_t buflen) {
+  ctx->xres = xres;
+  ctx->yres = yres;
+  ctx->runs = runs;
+  ctx->clr = clr;
+  ctx->max_runs = max_runs;
+  ctx->release = NULL;
+  ctx->buf = buf;
+  ctx->buflen = buflen;
+  ctx->emit = NULL;
+  ctx->user = NULL;
+  ctx->budget = 0;
+  ctx->degraded = 0;
+}
+
+// Starts a scan in the context's work area, for frames produced a few
+// lines at a time
+void ctx_scan(vgr2d_ctx_t *ctx, scan_t *scan, iter_base_t **iters, int n_iters) {
+  init_scan(scan, iters, n_iters, ctx->xres, ctx->yres, ctx->runs, ctx->clr, ctx->max_runs);
+  scan->release = ctx->release;
+}
+
+void ctx_render(vgr2d_ctx_t *ctx, iter_base_t **iters, int n_iters, span_sink_t *sink) {
+  scan_t scan;
+  ctx_scan(ctx, &scan, iters, n_iters);
+  while (scan_line(&scan, sink))
+    ;
+  end_scan(&scan);
+}
+
+// Encodes a whole frame. The last chunk, terminator included, is left in
+// buf and its length returned so the caller can end the transfer with it.
+size_t ctx_encode(vgr2d_ctx_t *ctx, iter_base_t **iters, int n_iters) {
+  encoder_t enc;
+  init_encoder(&enc, ctx->buf, ctx->buflen, ctx->emit, ctx->user);
+  enc.budget = ctx->budget;
+  ctx_render(ctx, iters, n_iters, &(enc.base));
+  ctx->degraded = enc.degraded;
+  size_t bufpos = enc.bufpos;
+  ctx->buf[bufpos++] = 0xff;
+  ctx->buf[bufpos++] = 0xff;
+  return bufpos;
+}
+
+
+//////////////////////////////////////// Scene file
+
+// Header: "VGSF", version, flags, then xres and yres high byte first,
+// followed by the encoded frame up to and including its terminator
+void scene_header(uint8_t *hdr, uint8_t flags, uint16_t xres, uint16_t yres) {
+  memcpy(hdr, SCENE_MAGIC, 4);
+  hdr[4] = SCENE_VERSION;
+  hdr[5] = flags;
+  hdr[6] = xres>>8;
+  hdr[7] = xres&0xff;
+  hdr[8] = yres>>8;
+  hdr[9] = yres&0xff;
+}
+
+// Returns false when the header is not a scene of a known version
+bool scene_parse_header(const uint8_t *hdr, uint8_t *flags, uint16_t *xres, uint16_t *yres) {
+  if (memcmp(hdr, SCENE_MAGIC, 4) != 0 || hdr[4] != SCENE_VERSION)
+    return false;
+  *flags = hdr[5];
+  *xres = (hdr[6]<<8)|hdr[7];
+  *yres = (hdr[8]<<8)|hdr[9];
+  return true;
+}
+
+// PackBits: a control byte n < 128 is followed by n+1 literal bytes,
+// n > 128 by one byte repeated 257-n times, 128 is unused. dst needs room
+// for PACKBITS_MAX(n) bytes. Returns the packed length.
+size_t packbits_encode(const uint8_t *src, size_t n, uint8_t *dst) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    size_t r = 1;
+    while (i+r < n && r < 128 && src[i+r] == src[i])
+      r++;
+    if (r >= 3) {
+      dst[o++] = 257-r;
+      dst[o++] = src[i];
+      i += r;
+    } else {
+      // literal up to the next run of three
+      size_t j = i, ctl = o++;
+      while (j < n && j-i < 128 &&
+	     !(j+2 < n && src[j] == src[j+1] && src[j] == src[j+2]))
+	dst[o++] = src[j++];
+      dst[ctl] = j-i-1;
+      i = j;
+    }
+  }
+  return o;
+}
+
+void init_unpacker(unpacker_t *u, uint8_t *out, size_t outlen, emit_t flush, void *user) {
+  u->out = out;
+  u->outlen = outlen;
+  u->outpos = 0;
+  u->flush = flush;
+  u->user = user;
+  u->lit = 0;
+  u->run = 0;
+}
+
+static void unpacker_byte(unpacker_t *u, uint8_t b) {
+  if (u->outpos == u->outlen) {
+    u->flush(u->user, u->out, u->outpos);
+    u->outpos = 0;
+  }
+  u->out[u->outpos++] = b;
+}
+
+// Unpacks a chunk of any size, state carries over to the next chunk. Full
+// output buffers go to flush, the remainder stays in out.
+void unpacker_put(unpacker_t *u, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t b = src[i];
+    if (u->lit > 0) {
+      unpacker_byte(u, b);
+      u->lit--;
+    } else if (u->run > 0) {
+      for (; u->run > 0; u->run--)
+	unpacker_byte(u, b);
+    } else if (b < 128) {
+      u->lit = b+1;
+    } else if (b > 128) {
+      u->run = 257-b;
+    }
+  }
+}
+
+
+//////////////////////////////////////// Capture
+
+// A capture holds the objects of a display list so a frame can be replayed
+// on the host. Header: "VGSC", version, xres, yres and the object count,
+// then one record per object starting with its CAPTURE_ type. All values
+// are high byte first, points and transforms in their internal units.
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v>>8;
+  p[1] = v&0xff;
+}
+
+static void capture_values(capture_t *cap, const uint16_t *v, int n) {
+  uint8_t buf[64];
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    put16(buf+k, v[i]);
+    k += 2;
+    if (k == sizeof(buf)) {
+      cap->emit(cap->user, buf, k);
+      k = 0;
+    }
+  }
+  if (k > 0)
+    cap->emit(cap->user, buf, k);
+}
+
+void capture_header(capture_t *cap, uint16_t xres, uint16_t yres, uint16_t n_objs) {
+  uint8_t buf[11];
+  memcpy(buf, CAPTURE_MAGIC, 4);
+  buf[4] = CAPTURE_VERSION;
+  put16(buf+5, xres);
+  put16(buf+7, yres);
+  put16(buf+9, n_objs);
+  cap->emit(cap->user, buf, sizeof(buf));
+}
+
+void capture_rect(capture_t *cap, rectangle_t *rect) {
+  uint8_t buf[12];
+  buf[0] = CAPTURE_RECT;
+  put16(buf+1, (uint16_t)rect->tr.tx);
+  put16(buf+3, (uint16_t)rect->tr.ty);
+  buf[5] = rect->fill | (rect->stroke<<1);
+  buf[6] = rect->fclr;
+  buf[7] = rect->sclr;
+  put16(buf+8, rect->w);
+  put16(buf+10, rect->h);
+  cap->emit(cap->user, buf, sizeof(buf));
+}
+
+void capture_batch(capture_t *cap, rect_batch_t *batch) {
+  uint8_t buf[7];
+  buf[0] = CAPTURE_BATCH;
+  put16(buf+1, (uint16_t)batch->tr.tx);
+  put16(buf+3, (uint16_t)batch->tr.ty);
+  put16(buf+5, batch->n);
+  cap->emit(cap->user, buf, sizeof(buf));
+  capture_values(cap, batch->x, batch->n);
+  capture_values(cap, batch->y, batch->n);
+  capture_values(cap, batch->w, batch->n);
+  capture_values(cap, batch->h, batch->n);
+  cap->emit(cap->user, batch->clr, batch->n);
+}
+
+void capture_polygon(capture_t *cap, polygon_t *poly) {
+  uint8_t buf[15];
+  buf[0] = CAPTURE_POLYGON;
+  put16(buf+1, (uint16_t)poly->tr.tx);
+  put16(buf+3, (uint16_t)poly->tr.ty);
+  buf[5] = poly->fill | (poly->stroke<<1);
+  buf[6] = poly->rule;
+  buf[7] = poly->fclr;
+  buf[8] = poly->sclr;
+  put16(buf+9, poly->width);
+  put16(buf+11, poly->n_pts);
+  put16(buf+13, poly->n_contours);
+  cap->emit(cap->user, buf, sizeof(buf));
+  capture_values(cap, poly->pts, poly->n_pts);
+  if (poly->n_contours > 1)
+    capture_values(cap, poly->ends, poly->n_contours);
+  put16(buf, poly->n_dash);
+  cap->emit(cap->user, buf, 2);
+  capture_values(cap, poly->dash, poly->n_dash);
+}
+
+// followed by the record of the shared polygon
+void capture_instance(capture_t *cap, instance_t *inst) {
+  uint8_t buf[7];
+  buf[0] = CAPTURE_INSTANCE;
+  put16(buf+1, (uint16_t)inst->tr.tx);
+  put16(buf+3, (uint16_t)inst->tr.ty);
+  buf[5] = inst->recolor;
+  buf[6] = inst->clr;
+  cap->emit(cap->user, buf, sizeof(buf));
+  capture_polygon(cap, inst->poly);
+}
+
+void capture_trace(capture_t *cap, trace_t *trace) {
+  uint8_t buf[12];
+  buf[0] = CAPTURE_TRACE;
+  put16(buf+1, (uint16_t)trace->tr.tx);
+  put16(buf+3, (uint16_t)trace->tr.ty);
+  put16(buf+5, trace->dx);
+  put16(buf+7, trace->width);
+  buf[9] = trace->clr;
+  put16(buf+10, trace->n_samples);
+  cap->emit(cap->user, buf, sizeof(buf));
+  capture_values(cap, trace->samples, trace->n_samples);
+}
+
+// runs of the layer as x1,x2 pairs per line, prefixed by the line's count
+void capture_layer(capture_t *cap, layer_t *layer) {
+  uint8_t buf[3];
+  buf[0] = CAPTURE_LAYER;
+  put16(buf+1, layer->height);
+  cap->emit(cap->user, buf, sizeof(buf));
+  for (int y = 0; y < layer->height; y++) {
+    uint32_t k = layer->start[y];
+    uint16_t n = layer->start[y+1] - k;
+    capture_values(cap, &n, 1);
+    capture_values(cap, layer->runs + 2*k, 2*n);
+    cap->emit(cap->user, layer->clr + k, n);
+  }
+}
+
+void capture_path(capture_t *cap, path_t *path) {
+  uint8_t buf[11];
+  buf[0] = CAPTURE_PATH;
+  put16(buf+1, (uint16_t)path->tr.tx);
+  put16(buf+3, (uint16_t)path->tr.ty);
+  buf[5] = path->rule;
+  buf[6] = path->fclr;
+  put16(buf+7, path->n_cmds);
+  put16(buf+9, path->n_pts);
+  cap->emit(cap->user, buf, sizeof(buf));
+  cap->emit(cap->user, path->cmds, path->n_cmds);
+  capture_values(cap, path->pts, path->n_pts);
+}
@@ -28,23 +28,46 @@ limitations under the License.
 #define XSCALE (1<<4)
 #define YSCALE 1
 
-#define MAX_ACTIVE 8
+#define MAX_ACTIVE 16
+#define MAX_RUNS 128 // runs per line of the smallest scan
+// Runs per line for a display xres wide, one per pixel being the most a
+// line can show, and the scan work area that holds three such lines
+#define LINE_RUNS(xres) ((XFX_INT(xres) > MAX_RUNS) ? XFX_INT(xres) : MAX_RUNS)
+#define SCAN_RUNS(line_runs) (3*(line_runs))
+
+#define RULE_EVENODD 0
+#define RULE_NONZERO 1
 
 
 typedef struct iter_base_s {
   size_t size;
+  bool resolved; // runs are already sorted without overlaps
   bool (*nextLine)(void *, uint16_t*);
-  bool (*nextRun)(void *, uint16_t, uint16_t*, uint16_t*, uint8_t*);
+  // writes all runs of a line as x1,x2 pairs with their colors, returns
+  // how many were written (at most the last argument)
+  int (*lineRuns)(void *, uint16_t, uint16_t*, uint8_t*, int);
+  // frees the scratch the iterator allocated, NULL when it has none
+  void (*freeScratch)(void *);
 } iter_base_t;
 
 typedef struct edge {
-  struct edge *next;
   uint16_t id;
   int16_t yTop, yBot;
   int16_t xNowWhole, xNowNum, xNowDen, xNowDir;
-  int16_t xNowNumStep;
+  int16_t xNowNumStep, xStepWhole; // per line x increment
+  int8_t wind;
 } edge_t;
 
+// Edges of a shape sorted by yTop, built when the shape is prepared and
+// only read by its iterators
+typedef struct edge_table_s {
+  edge_t *edges;
+  int16_t *bots; // scratch for counting max_active
+  int n_edges, max_edges;
+  int max_active; // most edges crossing one line
+  bool valid;
+} edge_table_t;
+
 typedef struct transform_s {
   float tx;
   float ty;
@@ -66,31 +89,308 @@ typedef struct rect_iter_s {
 } rect_iter_t;
 
 
+typedef struct rect_batch_s {
+  transform_t tr;
+  int n;
+  // parallel arrays, x in XFX units
+  uint16_t *x, *y, *w, *h;
+  uint8_t *clr;
+  uint16_t *order; // indices sorted by y
+  bool sorted;
+} rect_batch_t;
+
+typedef struct rect_batch_iter_s {
+  iter_base_t base;
+  rect_batch_t *batch;
+  uint16_t *active; // rects on the current line in x order
+  int n_active, idx, max_active;
+  uint16_t tx, ty, y;
+} rect_batch_iter_t;
+
+
 typedef struct polygon_s {
   transform_t tr;
   bool fill, stroke;
   uint8_t fclr,sclr;
+  uint8_t rule;
   uint16_t *pts;
-  int n_pts, width;
+  uint16_t *ends; // end of each closed contour in pts if more than one
+  int n_pts, n_contours, width;
+  int max_pts, max_contours; // allocated lengths of pts and ends
+  uint16_t *dash; // stroke on, off, ... lengths in x units, solid if none
+  int n_dash, max_dash;
+  uint16_t tol; // decimation tolerance in x units, 0 keeps every point
+  int dropped; // points the last decimation removed
+  uint8_t *keep; // decimation scratch, grown to the longest contour
+  int max_keep;
+  edge_table_t fill_tab, stroke_tab;
 } polygon_t;
 
 typedef struct poly_iter_s {
   iter_base_t base;
-  int idx; // next y not processed
-  edge_t **edges;
+  int idx; // next edge not yet active
+  const edge_t *edges; // shape's edge table
   int n_edges;
-  edge_t *active[MAX_ACTIVE];
-  int16_t x_coords[MAX_ACTIVE];
-  uint16_t idmap[MAX_ACTIVE];
+  // active edges, in the buffers below unless more cross one line
+  edge_t *active;
+  int16_t *x_coords;
+  uint16_t *idmap;
+  int8_t *wind;
+  uint16_t *past_ids; // merge_spans scratch
+  int16_t *past_x;
+  int max_active;
+  edge_t active_buf[MAX_ACTIVE];
+  int16_t x_buf[MAX_ACTIVE];
+  uint16_t id_buf[MAX_ACTIVE];
+  int8_t wind_buf[MAX_ACTIVE];
+  uint16_t past_id_buf[MAX_ACTIVE];
+  int16_t past_x_buf[MAX_ACTIVE];
   int n_active, cur, width;
-  uint16_t ty, tx, y0, y;
+  uint16_t ty, tx, y;
   bool fill, stroke;
   uint8_t fclr, sclr;
+  uint8_t rule;
 } poly_iter_t;
 
+// Fill and stroke of one polygon swept together, the border painted over
+// the interior so the runs come out resolved
+typedef struct outline_iter_s {
+  iter_base_t base;
+  poly_iter_t fill, stroke;
+  // runs of each sweep before they are overlaid, in the buffers below
+  // unless the active lists grow
+  uint16_t *inner, *border;
+  uint8_t *iclr, *bclr;
+  int max_runs;
+  uint16_t inner_buf[MAX_ACTIVE], border_buf[MAX_ACTIVE];
+  uint8_t iclr_buf[MAX_ACTIVE/2], bclr_buf[MAX_ACTIVE/2];
+} outline_iter_t;
+
+
+// A placement of a shared polygon at its own position and color
+typedef struct instance_s {
+  transform_t tr;
+  polygon_t *poly;
+  bool recolor;
+  uint8_t clr;
+} instance_t;
+
+
+// Path commands, each followed by its points in pts
+#define PATH_MOVE 0
+#define PATH_LINE 1
+#define PATH_QUAD 2
+#define PATH_CUBIC 3
+#define PATH_CLOSE 4
+
+// Curves are flattened until the chord is within a quarter pixel
+#define PATH_TOL (XSCALE>>2)
+#define PATH_MAX_SEGS 64
+
+// A filled outline of lines and Bezier curves, flattened straight into
+// its edge table
+typedef struct path_s {
+  transform_t tr;
+  uint8_t fclr;
+  uint8_t rule;
+  uint8_t *cmds;
+  uint16_t *pts; // x in XFX units
+  int n_cmds, n_pts;
+  int max_cmds, max_pts; // allocated lengths of cmds and pts
+  edge_table_t fill_tab;
+} path_t;
+
+
+
+// A plot of samples spaced dx apart drawn as one stroke
+typedef struct trace_s {
+  transform_t tr;
+  uint16_t *samples; // y values
+  int n_samples, max_samples;
+  uint16_t dx; // XFX units
+  uint16_t width;
+  uint8_t clr;
+  uint16_t *order; // segments sorted by top
+  bool sorted;
+} trace_t;
+
+typedef struct trace_iter_s {
+  iter_base_t base;
+  trace_t *trace;
+  uint16_t *active; // segments on the current line in x order
+  int n_active, idx, max_active;
+  uint16_t tx, ty, y;
+} trace_iter_t;
+
+
+// Lines of spans resolved ahead of time
+typedef struct layer_s {
+  uint16_t height;
+  uint32_t *start; // height+1 offsets of each line's runs
+  uint16_t *runs;
+  uint8_t *clr;
+  uint32_t n_runs;
+} layer_t;
+
+typedef struct layer_iter_s {
+  iter_base_t base;
+  layer_t *layer;
+  uint16_t y;
+} layer_iter_t;
+
+
+// Receives each resolved line as n runs of x1,x2 pairs in x order
+typedef struct span_sink_s {
+  void (*line)(struct span_sink_s *, uint16_t, uint16_t*, uint8_t*, int);
+} span_sink_t;
+
+// Receives output as a buffer fills, user is the caller's context
+typedef void (*emit_t)(void *user, uint8_t *buf, size_t len);
+
+// Encodes lines to FPGA commands, emit is called as the buffer fills, a
+// run at a time within a line. The buffer needs min_line_budget(xres)
+// bytes plus 2 for the terminator.
+// With a budget, lines that would take more bytes are simplified until
+// they fit so the FPGA can always keep up with the scan.
+typedef struct encoder_s {
+  span_sink_t base;
+  uint8_t *buf;
+  size_t buflen, bufpos;
+  uint16_t prevY;
+  size_t budget; // max bytes per line, 0 for no limit
+  uint32_t degraded; // lines simplified to fit the budget
+  emit_t emit;
+  void *user;
+} encoder_t;
+
+// Fills lines into an 8-bit framebuffer of width*height pixels
+typedef struct framebuffer_s {
+  span_sink_t base;
+  uint8_t *pixels;
+  int width, height;
+} framebuffer_t;
+
+// Compiles lines into a layer, first counting then storing the runs
+typedef struct layer_sink_s {
+  span_sink_t base;
+  layer_t *layer;
+} layer_sink_t;
+
+// Streaming PackBits decoder for scene files
+typedef struct unpacker_s {
+  uint8_t *out;
+  size_t outlen, outpos;
+  emit_t flush;
+  void *user;
+  int lit, run; // bytes left of the current literal or run
+} unpacker_t;
+
+#define SCENE_MAGIC "VGSF"
+#define SCENE_VERSION 1
+#define SCENE_HEADER_SIZE 10
+#define SCENE_PACKBITS 0x01 // flags: payload is PackBits compressed
+
+#define PACKBITS_MAX(n) ((n) + ((n)+127)/128)
+
+#define CAPTURE_MAGIC "VGSC"
+#define CAPTURE_VERSION 2
+
+// Capture record types
+#define CAPTURE_RECT 1
+#define CAPTURE_BATCH 2
+#define CAPTURE_POLYGON 3
+#define CAPTURE_INSTANCE 4
+#define CAPTURE_TRACE 5
+#define CAPTURE_LAYER 6
+#define CAPTURE_PATH 7
+
+// Where capture records are written
+typedef struct capture_s {
+  emit_t emit;
+  void *user;
+} capture_t;
+
+// Line by line sweep over a set of iterators
+typedef struct scan_s {
+  iter_base_t **iters; // finished iterators are set to NULL
+  int n_iters;
+  int xres, yres;
+  uint16_t *runs; // room for SCAN_RUNS(max_runs) runs
+  uint8_t *clr;
+  int max_runs; // runs per line
+  void (*release)(iter_base_t *); // optional, frees finished iterators
+} scan_t;
+
+// What one renderer needs for a frame: resolution, the scan work area and
+// the encoder output. Contexts share no state, so frames for different
+// displays can be produced at the same time, a thread per context, once
+// every object drawn has been prepared. Preparing builds what the
+// iterators read, the sweeps then only read the objects.
+typedef struct vgr2d_ctx_s {
+  int xres, yres; // xres in XFX units
+  uint16_t *runs; // room for SCAN_RUNS(max_runs) runs
+  uint8_t *clr;
+  int max_runs; // runs per line, LINE_RUNS(xres) shows every pixel
+  void (*release)(iter_base_t *); // optional, frees finished iterators
+  uint8_t *buf; // encoder output, flushed to emit as it fills
+  size_t buflen;
+  emit_t emit;
+  void *user;
+  size_t budget; // max bytes per encoded line, 0 for no limit
+  uint32_t degraded; // lines simplified in the last encoded frame
+} vgr2d_ctx_t;
 
 extern void init_transform(transform_t *tr);
 extern void init_rectangle_iter(rectangle_t *rect, rect_iter_t *iter);
+extern void prepare_rect_batch(rect_batch_t *batch);
+extern void init_rect_batch_iter(rect_batch_t *batch, rect_batch_iter_t *iter);
+extern void init_polygon(polygon_t *poly);
+extern void polygon_changed(polygon_t *poly);
+extern void simplify_polygon(polygon_t *poly);
+extern void prepare_polygon(polygon_t *poly);
 extern void init_polygon_iter(polygon_t *poly, poly_iter_t *iter);
+extern void init_outline_iter(polygon_t *poly, outline_iter_t *iter);
+extern void prepare_instance(instance_t *inst);
+extern void init_instance_iter(instance_t *inst, poly_iter_t *iter);
+extern void init_instance_outline_iter(instance_t *inst, outline_iter_t *iter);
+extern int path_cmd_points(uint8_t cmd);
+extern void init_path(path_t *path);
+extern void path_changed(path_t *path);
+extern void prepare_path(path_t *path);
+extern void init_path_iter(path_t *path, poly_iter_t *iter);
+extern void trace_changed(trace_t *trace);
+extern void prepare_trace(trace_t *trace);
+extern void init_trace_iter(trace_t *trace, trace_iter_t *iter);
+
+extern void init_scan(scan_t *scan, iter_base_t **iters, int n_iters, int xres, int yres, uint16_t *runs, uint8_t *clr, int max_runs);
+extern bool scan_line(scan_t *scan, span_sink_t *sink);
+extern void free_iter_scratch(iter_base_t *iter);
+extern void end_scan(scan_t *scan);
+extern void init_ctx(vgr2d_ctx_t *ctx, int xres, int yres, uint16_t *runs, uint8_t *clr, int max_runs, uint8_t *buf, size_t buflen);
+extern void ctx_scan(vgr2d_ctx_t *ctx, scan_t *scan, iter_base_t **iters, int n_iters);
+extern void ctx_render(vgr2d_ctx_t *ctx, iter_base_t **iters, int n_iters, span_sink_t *sink);
+extern size_t ctx_encode(vgr2d_ctx_t *ctx, iter_base_t **iters, int n_iters);
+extern void init_encoder(encoder_t *enc, uint8_t *buf, size_t buflen, emit_t emit, void *user);
+extern size_t min_line_budget(uint16_t xres);
+extern void init_framebuffer(framebuffer_t *fb, uint8_t *pixels, int width, int height);
+extern void init_layer(layer_t *layer, int height);
+extern void init_layer_sink(layer_sink_t *sink, layer_t *layer);
+extern void layer_counted(layer_t *layer);
+extern void init_layer_iter(layer_t *layer, layer_iter_t *iter);
+
+extern void scene_header(uint8_t *hdr, uint8_t flags, uint16_t xres, uint16_t yres);
+extern bool scene_parse_header(const uint8_t *hdr, uint8_t *flags, uint16_t *xres, uint16_t *yres);
+extern size_t packbits_encode(const uint8_t *src, size_t n, uint8_t *dst);
+extern void init_unpacker(unpacker_t *u, uint8_t *out, size_t outlen, emit_t flush, void *user);
+extern void unpacker_put(unpacker_t *u, const uint8_t *src, size_t n);
+
+extern void capture_header(capture_t *cap, uint16_t xres, uint16_t yres, uint16_t n_objs);
+extern void capture_rect(capture_t *cap, rectangle_t *rect);
+extern void capture_batch(capture_t *cap, rect_batch_t *batch);
+extern void capture_polygon(capture_t *cap, polygon_t *poly);
+extern void capture_instance(capture_t *cap, instance_t *inst);
+extern void capture_trace(capture_t *cap, trace_t *trace);
+extern void capture_layer(capture_t *cap, layer_t *layer);
+extern void capture_path(capture_t *cap, path_t *path);
 
 #endif
@@ -0,0 +1,1244 @@
+/*
+
+Copyright 2023 StreamLogic, LLC.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+*/
+
+// Host microbenchmarks of the rasterizer stages.
+//
+// Build and run from the repository root:
+//   cc -O2 -o vgr2d_bench tools/vgr2d_bench.c -lm
+//   ./vgr2d_bench -s baseline.txt            record a baseline
+//   ./vgr2d_bench -c baseline.txt [-t 10]    fail on a >10% slowdown
+//   ./vgr2d_bench -r frame.vgsc ...          also replay captured frames
+//   ./vgr2d_bench -b 32 -r frame.vgsc        replay with a line budget
+//   ./vgr2d_bench -r frame.vgsc -w frame.vgsf [-z]
+//                                            also write the last replayed frame
+//                                            as a scene file for display_file()
+//
+// Timings are printed as "name ns_per_op" and counts, such as the points
+// left after simplifying or the lines, runs and bytes of a replayed frame,
+// as "name count n". With -c the exit status is 1 when any timing is slower
+// than its baseline by more than the threshold or any count differs from
+// it. With -b the replayed frames also count the lines simplified to fit
+// the budget.
+//
+// Before timing anything a few scenes are rendered into a framebuffer and
+// compared against the pixels they must produce. A failed check is printed
+// to stderr and makes the exit status 1.
+
+// the library is included so its static stages can be timed directly
+#include "../src/vgr2dlib.c"
+#undef printf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#define MAX_RESULTS 128
+#define MAX_REPLAYS 16
+#define BENCH_RUNS LINE_RUNS(XFX(800)) // runs per line of the widest bench scan
+#define REPEATS 5
+#define MAX_SHAPES 32 // polygons in one bench frame
+// encoder buffer, the module's SPI transfer size, well above the
+// min_line_budget() plus terminator the encoder needs at any bench width
+#define BENCH_BUF 254
+
+void *vgr2d_alloc(size_t size, int n) {
+  return calloc(n, size);
+}
+
+void vgr2d_free(void *ptr, size_t size, int n) {
+  (void)size;
+  (void)n;
+  free(ptr);
+}
+
+typedef struct result_s {
+  char name[48];
+  double value;
+  bool count; // compared exactly, not as a timing
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int n_results;
+static int failed_checks;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static void add_result(const char *name, double value, bool count) {
+  if (n_results < MAX_RESULTS) {
+    snprintf(results[n_results].name, sizeof(results[0].name), "%s", name);
+    results[n_results].value = value;
+    results[n_results++].count = count;
+  }
+}
+
+static void report(const char *name, double ns) {
+  add_result(name, ns, false);
+  printf("%s %.1f\n", name, ns);
+}
+
+static void report_count(const char *name, long n) {
+  add_result(name, n, true);
+  printf("%s count %ld\n", name, n);
+}
+
+// Times ops calls of fn, the best of REPEATS runs guards against noise
+#define BENCH(name, ops, setup, body) do {      \
+    double best = 1e30;                         \
+    for (int rep = 0; rep < REPEATS; rep++) {   \
+      setup;                                    \
+      double t0 = now_ns();                     \
+      for (int op = 0; op < (ops); op++) {      \
+	body;                                   \
+      }                                         \
+      double t = (now_ns()-t0)/(ops);           \
+      if (t < best) best = t;                   \
+    }                                           \
+    report(name, best);                         \
+  } while (0)
+
+
+//////////////////////////////////////// Inputs
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(void) {
+  rnd_state = rnd_state*1103515245u + 12345u;
+  return rnd_state>>8;
+}
+
+// Polygon of n points in the bench colors, filled or stroked, the caller
+// sets the points and calls polygon_changed()
+static void make_polygon(polygon_t *poly, int n, bool fill) {
+  init_polygon(poly);
+  poly->pts = (uint16_t *)calloc(2*n, sizeof(uint16_t));
+  poly->n_pts = 2*n;
+  poly->max_pts = poly->n_pts;
+  poly->fill = fill;
+  poly->stroke = !fill;
+  poly->rule = RULE_EVENODD;
+  poly->fclr = 1;
+  poly->sclr = 2;
+  poly->width = 1;
+}
+
+// Closed star of n points centered at cx,cy, alternating radii
+static void make_star(polygon_t *poly, int n, int cx, int cy, int r) {
+  make_polygon(poly, n+1, true);
+  for (int i = 0; i < n; i++) {
+    double a = 2*M_PI*i/n;
+    int ri = (i&1) ? r/2 : r;
+    poly->pts[2*i] = XFX(cx) + (int)(XFX(ri)*cos(a));
+    poly->pts[2*i+1] = cy + (int)(ri*sin(a));
+  }
+  poly->pts[2*n] = poly->pts[0];
+  poly->pts[2*n+1] = poly->pts[1];
+  polygon_changed(poly);
+}
+
+// Open zigzag trace of n samples across w pixels
+static void make_trace(polygon_t *poly, int n, int w, int h, int width) {
+  make_polygon(poly, n, false);
+  for (int i = 0; i < n; i++) {
+    poly->pts[2*i] = XFX(i*w/n);
+    poly->pts[2*i+1] = rnd()%h;
+  }
+  poly->width = width;
+  polygon_changed(poly);
+}
+
+// Smooth sensor trace of n samples across w pixels with a pixel of noise,
+// many more points than the display resolves
+static void make_sensor(polygon_t *poly, int n, int w) {
+  make_polygon(poly, n, false);
+  for (int i = 0; i < n; i++) {
+    poly->pts[2*i] = i*XFX(w)/n;
+    poly->pts[2*i+1] = 120 + (int)(60*sin(8*M_PI*i/n)) + rnd()%2;
+  }
+  polygon_changed(poly);
+}
+
+// Straight line from x1,y1 to x2,y2 in pixels
+static void make_line(polygon_t *poly, int x1, int y1, int x2, int y2) {
+  make_polygon(poly, 2, false);
+  poly->pts[0] = XFX(x1);
+  poly->pts[1] = y1;
+  poly->pts[2] = XFX(x2);
+  poly->pts[3] = y2;
+  polygon_changed(poly);
+}
+
+// Comb of n teeth, deep notches give a line many fill and stroke crossings
+static void make_comb(polygon_t *poly, int n, bool fill, bool stroke) {
+  make_polygon(poly, 4*n+3, fill);
+  uint16_t *p = poly->pts;
+  *p++ = XFX(10);
+  *p++ = 200;
+  for (int t = 0; t < n; t++) {
+    int x = 10 + 12*t;
+    *p++ = XFX(x);
+    *p++ = 40;
+    *p++ = XFX(x+6);
+    *p++ = 40;
+    *p++ = XFX(x+6);
+    *p++ = 180;
+    *p++ = XFX(x+12);
+    *p++ = 180;
+  }
+  *p++ = XFX(10 + 12*n);
+  *p++ = 200;
+  *p++ = poly->pts[0];
+  *p++ = poly->pts[1];
+  poly->stroke = stroke;
+  poly->width = 2;
+  polygon_changed(poly);
+}
+
+// Circle of n cubic arcs, closed
+static void make_round_path(path_t *path, int n, int cx, int cy, int r) {
+  init_path(path);
+  path->cmds = (uint8_t *)calloc(n+2, 1);
+  path->pts = (uint16_t *)calloc(2+6*n, sizeof(uint16_t));
+  double k = 4.0/3.0*tan(M_PI/(2*n)); // control distance of an arc
+  int j = 0;
+  path->cmds[path->n_cmds++] = PATH_MOVE;
+  path->pts[j++] = XFX(cx+r);
+  path->pts[j++] = cy;
+  for (int i = 0; i < n; i++) {
+    double a0 = 2*M_PI*i/n, a1 = 2*M_PI*(i+1)/n;
+    path->cmds[path->n_cmds++] = PATH_CUBIC;
+    path->pts[j++] = XFX(cx) + (int)(XFX(r)*(cos(a0) - k*sin(a0)));
+    path->pts[j++] = cy + (int)(r*(sin(a0) + k*cos(a0)));
+    path->pts[j++] = XFX(cx) + (int)(XFX(r)*(cos(a1) + k*sin(a1)));
+    path->pts[j++] = cy + (int)(r*(sin(a1) - k*cos(a1)));
+    path->pts[j++] = XFX(cx) + (int)(XFX(r)*cos(a1));
+    path->pts[j++] = cy + (int)(r*sin(a1));
+  }
+  path->cmds[path->n_cmds++] = PATH_CLOSE;
+  path->n_pts = j;
+  path->fclr = 3;
+}
+
+// k random runs of a line, the spans sort_runs and the encoder receive
+static void make_runs(uint16_t *runs, uint8_t *clr, int k, int xres) {
+  for (int i = 0; i < k; i++) {
+    uint16_t x1 = rnd()%XFX(xres);
+    uint16_t x2 = x1 + rnd()%XFX(xres/k+8);
+    runs[2*i] = x1;
+    runs[2*i+1] = x2;
+    clr[i] = 1 + rnd()%7;
+  }
+}
+
+static void discard(void *user, uint8_t *buf, size_t len) {
+  (void)user;
+  (void)buf;
+  (void)len;
+}
+
+static void sweep(iter_base_t *iter) {
+  static uint16_t runs[2*MAX_RUNS];
+  static uint8_t clr[MAX_RUNS];
+  uint16_t y;
+  while (iter->nextLine(iter, &y))
+    iter->lineRuns(iter, y, runs, clr, MAX_RUNS);
+  free_iter_scratch(iter);
+}
+
+// Sweeps a prepared polygon through its own iterator, without a scan
+static void sweep_polygon(polygon_t *poly) {
+  poly_iter_t iter;
+  init_polygon_iter(poly, &iter);
+  sweep((iter_base_t *)&iter);
+}
+
+// Iterators of n prepared polygons in list order, one outline iterator
+// for a polygon both filled and stroked as the module makes them
+static iter_base_t **list_polygons(polygon_t *shapes, int n) {
+  static poly_iter_t iters[MAX_SHAPES];
+  static outline_iter_t outlines[MAX_SHAPES];
+  static iter_base_t *list[MAX_SHAPES];
+  for (int i = 0; i < n; i++) {
+    if (shapes[i].fill && shapes[i].stroke) {
+      init_outline_iter(&shapes[i], &outlines[i]);
+      list[i] = (iter_base_t *)&outlines[i];
+    } else {
+      init_polygon_iter(&shapes[i], &iters[i]);
+      list[i] = (iter_base_t *)&iters[i];
+    }
+  }
+  return list;
+}
+
+// A w by h context over the bench scan buffers, its frames discarded
+static void bench_ctx(vgr2d_ctx_t *ctx, int w, int h) {
+  static uint16_t runs[2*SCAN_RUNS(BENCH_RUNS)];
+  static uint8_t clr[SCAN_RUNS(BENCH_RUNS)];
+  static uint8_t buf[BENCH_BUF];
+  init_ctx(ctx, XFX(w), h, runs, clr, LINE_RUNS(XFX(w)), buf, sizeof(buf));
+  ctx->emit = discard;
+}
+
+// Times encoding whole frames of n prepared polygons
+static void bench_frame(const char *name, int ops, polygon_t *shapes, int n, int w, int h) {
+  vgr2d_ctx_t ctx;
+  bench_ctx(&ctx, w, h);
+  for (int i = 0; i < n; i++)
+    prepare_polygon(&shapes[i]);
+  BENCH(name, ops, , ctx_encode(&ctx, list_polygons(shapes, n), n));
+}
+
+// Frees what a polygon and its prepared tables hold, its dash pattern
+// belongs to the caller
+static void free_polygon(polygon_t *poly) {
+  free(poly->pts);
+  free(poly->ends);
+  free(poly->keep);
+  free(poly->fill_tab.edges);
+  free(poly->fill_tab.bots);
+  free(poly->stroke_tab.edges);
+  free(poly->stroke_tab.bots);
+}
+
+static void free_polygons(polygon_t *shapes, int n) {
+  for (int i = 0; i < n; i++)
+    free_polygon(&shapes[i]);
+}
+
+
+//////////////////////////////////////// Benchmarks
+
+static void bench_fill_edges(void) {
+  static const int sizes[] = { 8, 64, 512 };
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    polygon_t poly;
+    make_star(&poly, sizes[s], 200, 120, 100);
+    edge_t *edges = (edge_t *)calloc(sizes[s], sizeof(edge_t));
+    snprintf(name, sizeof(name), "fill_edges/edges=%d", sizes[s]);
+    BENCH(name, 2000, , {
+	int n = fill_edges(0, poly.pts, poly.n_pts, edges, 0);
+	sort_edges(edges, n);
+      });
+    free(edges);
+    free_polygon(&poly);
+  }
+}
+
+// Every line of a filled star, active edges stepped and spans paired
+static void bench_fill_sweep(void) {
+  static const int sizes[] = { 8, 64, 512 };
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    polygon_t poly;
+    make_star(&poly, sizes[s], 200, 120, 100);
+    prepare_polygon(&poly);
+    snprintf(name, sizeof(name), "fill_sweep/edges=%d", sizes[s]);
+    BENCH(name, 200, , sweep_polygon(&poly));
+    free_polygon(&poly);
+  }
+}
+
+// Every line of a stroked trace, overlapping segments merged by merge_spans
+static void bench_stroke_sweep(void) {
+  static const int widths[] = { 1, 3, 8 };
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    polygon_t poly;
+    make_trace(&poly, 64, 320, 200, widths[s]);
+    prepare_polygon(&poly);
+    snprintf(name, sizeof(name), "stroke_sweep/width=%d", widths[s]);
+    BENCH(name, 200, , sweep_polygon(&poly));
+    free_polygon(&poly);
+  }
+}
+
+// Flattening the curves into the edge table, then sweeping the result
+static void bench_path(void) {
+  static const int sizes[] = { 4, 16, 64 };
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    path_t path;
+    poly_iter_t iter;
+    make_round_path(&path, sizes[s], 200, 120, 100);
+    snprintf(name, sizeof(name), "path_flatten/curves=%d", sizes[s]);
+    BENCH(name, 200, , {
+	path_changed(&path);
+	prepare_path(&path);
+      });
+    snprintf(name, sizeof(name), "path_sweep/curves=%d", sizes[s]);
+    BENCH(name, 200, , {
+	init_path_iter(&path, &iter);
+	sweep((iter_base_t *)&iter);
+      });
+    free(path.cmds);
+    free(path.pts);
+    free(path.fill_tab.edges);
+    free(path.fill_tab.bots);
+  }
+}
+
+// Bordered shapes as a fill and a stroke object or as one outlined polygon
+static void bench_outline(void) {
+  polygon_t pairs[8], single[4];
+  for (int i = 0; i < 8; i++) {
+    // fill and its stroke next to each other
+    make_star(&pairs[i], 10, 320*((i>>1)+1)/5, 120, 48);
+    pairs[i].fill = !(i&1);
+    pairs[i].stroke = (i&1);
+    pairs[i].width = 3;
+  }
+  for (int i = 0; i < 4; i++) {
+    make_star(&single[i], 10, 320*(i+1)/5, 120, 48);
+    single[i].stroke = true;
+    single[i].width = 3;
+  }
+  bench_frame("outline/pair", 50, pairs, 8, 320, 240);
+  bench_frame("outline/single", 50, single, 4, 320, 240);
+  free_polygons(pairs, 8);
+  free_polygons(single, 4);
+}
+
+// Grid of 16 horizontal and 16 vertical lines, solid or dashed
+static void bench_dash(void) {
+  static uint16_t pattern[] = { XFX(6), XFX(4) };
+  polygon_t lines[32];
+  for (int i = 0; i < 16; i++) {
+    make_line(&lines[i], 0, 8 + 14*i, 319, 8 + 14*i);
+    make_line(&lines[16+i], 8 + 20*i, 0, 8 + 20*i, 239);
+  }
+  for (int d = 0; d < 2; d++) {
+    for (int i = 0; i < 32; i++) {
+      lines[i].dash = d ? pattern : NULL;
+      lines[i].n_dash = d ? 2 : 0;
+      polygon_changed(&lines[i]);
+    }
+    bench_frame(d ? "dash/grid=dashed" : "dash/grid=solid", 50, lines, 32, 320, 240);
+  }
+  free_polygons(lines, 32);
+}
+
+// Decimation of a dense trace and the sweep it saves, tol in x units
+static void bench_simplify(void) {
+  static const int tols[] = { 0, XSCALE/2, XSCALE };
+  char name[48];
+  polygon_t sensor;
+  make_sensor(&sensor, 2048, 320);
+  for (int s = 0; s < 3; s++) {
+    polygon_t poly = sensor;
+    poly.pts = (uint16_t *)calloc(sensor.n_pts, sizeof(uint16_t));
+    poly.tol = tols[s];
+    snprintf(name, sizeof(name), "simplify/tol=%d", tols[s]);
+    BENCH(name, 50, , {
+	memcpy(poly.pts, sensor.pts, sensor.n_pts*sizeof(uint16_t));
+	poly.n_pts = sensor.n_pts;
+	simplify_polygon(&poly);
+      });
+    prepare_polygon(&poly);
+    snprintf(name, sizeof(name), "simplify/tol=%d/sweep", tols[s]);
+    BENCH(name, 50, , sweep_polygon(&poly));
+    snprintf(name, sizeof(name), "simplify/tol=%d/points", tols[s]);
+    report_count(name, poly.n_pts>>1);
+    free_polygon(&poly);
+  }
+  free_polygon(&sensor);
+}
+
+static void bench_sort_runs(void) {
+  static const int density[] = { 4, 32, 128 };
+  static uint16_t src[2*MAX_RUNS], runs[2*MAX_RUNS];
+  static uint8_t sclr[MAX_RUNS], clr[MAX_RUNS];
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    int k = density[s];
+    make_runs(src, sclr, k, 320);
+    snprintf(name, sizeof(name), "sort_runs/runs=%d", k);
+    BENCH(name, 20000, , {
+	memcpy(runs, src, 4*k);
+	memcpy(clr, sclr, k);
+	sort_runs(runs, clr, 2*k);
+      });
+  }
+}
+
+static void bench_encode(void) {
+  static const int density[] = { 1, 16, 64 };
+  static uint16_t src[2*MAX_RUNS], runs[2*MAX_RUNS];
+  static uint8_t sclr[MAX_RUNS], clr[MAX_RUNS];
+  static uint8_t buf[BENCH_BUF];
+  char name[48];
+  for (int s = 0; s < 3; s++) {
+    int k = density[s];
+    encoder_t enc;
+    // long spans and gaps exercise split_span
+    make_runs(src, sclr, k, 1600);
+    int n = sort_runs(src, sclr, 2*k)>>1;
+    init_encoder(&enc, buf, sizeof(buf), discard, NULL);
+    snprintf(name, sizeof(name), "encode/runs=%d", k);
+    BENCH(name, 20000, , {
+	memcpy(runs, src, 4*n);
+	memcpy(clr, sclr, n);
+	enc.base.line(&(enc.base), 1+(op&0xff), runs, clr, n);
+      });
+  }
+
+  // lines over the budget are simplified a gap or sliver at a time
+  for (int s = 1; s < 3; s++) {
+    int k = density[s];
+    encoder_t enc;
+    make_runs(src, sclr, k, 1600);
+    int n = sort_runs(src, sclr, 2*k)>>1;
+    init_encoder(&enc, buf, sizeof(buf), discard, NULL);
+    enc.budget = 32;
+    snprintf(name, sizeof(name), "encode/runs=%d/budget=32", k);
+    BENCH(name, 2000, , {
+	memcpy(runs, src, 4*n);
+	memcpy(clr, sclr, n);
+	enc.base.line(&(enc.base), 1+(op&0xff), runs, clr, n);
+      });
+  }
+}
+
+static void bench_generator(void) {
+  static const int res[][2] = { { 320, 240 }, { 800, 480 } };
+  char name[48];
+  for (int s = 0; s < 2; s++) {
+    int w = res[s][0], h = res[s][1];
+    polygon_t shapes[8];
+    for (int i = 0; i < 4; i++)
+      make_star(&shapes[i], 10, w*(i+1)/5, h/2, h/5);
+    for (int i = 4; i < 8; i++)
+      make_trace(&shapes[i], 64, w, h, 2);
+    snprintf(name, sizeof(name), "generator/res=%dx%d", w, h);
+    bench_frame(name, 50, shapes, 8, w, h);
+    free_polygons(shapes, 8);
+  }
+}
+
+
+//////////////////////////////////////// Checks
+
+#define CHECK_W 800
+#define CHECK_H 240
+
+static void check(const char *name, bool ok, const char *why) {
+  if (ok)
+    printf("check/%s ok\n", name);
+  else {
+    fprintf(stderr, "CHECK FAILED %s: %s\n", name, why);
+    failed_checks++;
+  }
+}
+
+// Renders n prepared polygons into a cleared CHECK_W by CHECK_H framebuffer
+static void render_polygons(polygon_t *shapes, int n, uint8_t *pixels) {
+  static uint16_t runs[2*SCAN_RUNS(LINE_RUNS(XFX(CHECK_W)))];
+  static uint8_t clr[SCAN_RUNS(LINE_RUNS(XFX(CHECK_W)))];
+  vgr2d_ctx_t ctx;
+  framebuffer_t fb;
+  for (int i = 0; i < n; i++)
+    prepare_polygon(&shapes[i]);
+  memset(pixels, 0, CHECK_W*CHECK_H);
+  init_framebuffer(&fb, pixels, CHECK_W, CHECK_H);
+  init_ctx(&ctx, XFX(CHECK_W), CHECK_H, runs, clr, LINE_RUNS(XFX(CHECK_W)), NULL, 0);
+  ctx_render(&ctx, list_polygons(shapes, n), n, &(fb.base));
+}
+
+// A pixel is lit when its center is inside, lines run from yTop to yBot
+static void check_square(void) {
+  static uint8_t px[CHECK_W*CHECK_H];
+  polygon_t sq;
+  make_polygon(&sq, 5, true);
+  uint16_t pts[] = { XFX(10), 10, XFX(50), 10, XFX(50), 40, XFX(10), 40, XFX(10), 10 };
+  memcpy(sq.pts, pts, sizeof(pts));
+  polygon_changed(&sq);
+  render_polygons(&sq, 1, px);
+  int wrong = 0;
+  for (int y = 0; y < CHECK_H; y++)
+    for (int x = 0; x < CHECK_W; x++)
+      wrong += px[y*CHECK_W+x] != ((10 <= x && x < 50 && 10 <= y && y <= 40) ? sq.fclr : 0);
+  check("square", wrong == 0, "pixels outside the 40x31 block or missing from it");
+  free_polygon(&sq);
+}
+
+// Drawing a bordered polygon as one outline or as a fill and a stroke
+// must give the same pixels, also where the comb packs many crossings
+static void check_outline(void) {
+  static uint8_t one[CHECK_W*CHECK_H], two[CHECK_W*CHECK_H];
+  polygon_t outline, pair[2];
+  make_comb(&outline, 24, true, true);
+  make_comb(&pair[0], 24, true, false);
+  make_comb(&pair[1], 24, false, true);
+  render_polygons(&outline, 1, one);
+  render_polygons(pair, 2, two);
+  int lit = 0;
+  for (int i = 0; i < CHECK_W*CHECK_H; i++)
+    lit += one[i] != 0;
+  check("outline", lit > 0 && memcmp(one, two, sizeof(one)) == 0,
+	"outline differs from the fill and stroke pair");
+  free_polygon(&outline);
+  free_polygons(pair, 2);
+}
+
+// Every dash of a line across the frame is drawn, one every 6 pixels, more
+// dashes than MAX_RUNS so none are lost to a per-line limit
+static void check_dash(void) {
+  static uint8_t px[CHECK_W*CHECK_H];
+  static uint16_t pattern[] = { XFX(2), XFX(4) };
+  polygon_t line;
+  make_line(&line, 0, 100, CHECK_W-1, 100);
+  line.dash = pattern;
+  line.n_dash = 2;
+  polygon_changed(&line);
+  render_polygons(&line, 1, px);
+  int dashes = 0, last = -1;
+  for (int x = 0; x < CHECK_W; x++) {
+    if (px[100*CHECK_W+x] != 0) {
+      if (x == 0 || px[100*CHECK_W+x-1] == 0)
+	dashes++;
+      last = x;
+    }
+  }
+  check("dash", dashes == (CHECK_W+5)/6 && last >= CHECK_W-6, "dashes missing along the line");
+  free_polygon(&line);
+}
+
+// Two squares as contours, with empty contours around the second when
+// gaps is set, filled and stroked with a dash pattern
+static void make_squares(polygon_t *poly, bool gaps) {
+  static const uint16_t sq[] = { 0, 0, 40, 0, 40, 30, 0, 30, 0, 0 };
+  static uint16_t pattern[] = { XFX(6), XFX(4) };
+  int n_ends = gaps ? 5 : 2, k = 0;
+  make_polygon(poly, 10, true);
+  poly->ends = (uint16_t *)calloc(n_ends, sizeof(uint16_t));
+  if (gaps)
+    poly->ends[k++] = 0;
+  for (int c = 0; c < 2; c++) {
+    for (int i = 0; i < 10; i += 2) {
+      poly->pts[10*c+i] = XFX(20 + 60*c + sq[i]);
+      poly->pts[10*c+i+1] = 20 + sq[i+1];
+    }
+    poly->ends[k++] = 10*(c+1);
+    if (gaps)
+      poly->ends[k++] = 10*(c+1);
+  }
+  poly->n_contours = n_ends;
+  poly->max_contours = n_ends;
+  poly->stroke = true;
+  poly->width = 3;
+  poly->dash = pattern;
+  poly->n_dash = 2;
+  polygon_changed(poly);
+}
+
+// Empty contours draw nothing and leave the others as they were, a
+// polygon with no points at all draws nothing
+static void check_empty_contours(void) {
+  static uint8_t with[CHECK_W*CHECK_H], without[CHECK_W*CHECK_H];
+  polygon_t gaps, plain, empty;
+  make_squares(&gaps, true);
+  make_squares(&plain, false);
+  render_polygons(&gaps, 1, with);
+  render_polygons(&plain, 1, without);
+  bool same = memcmp(with, without, sizeof(with)) == 0;
+  // fill alone goes through the fill table only
+  gaps.stroke = plain.stroke = false;
+  render_polygons(&gaps, 1, with);
+  render_polygons(&plain, 1, without);
+  same = same && memcmp(with, without, sizeof(with)) == 0;
+  make_polygon(&empty, 0, true);
+  polygon_changed(&empty);
+  render_polygons(&empty, 1, with);
+  int lit = 0;
+  for (int i = 0; i < CHECK_W*CHECK_H; i++)
+    lit += with[i] != 0;
+  check("empty_contours", same && lit == 0, "empty contours changed the drawing");
+  free_polygon(&gaps);
+  free_polygon(&plain);
+  free_polygon(&empty);
+}
+
+static void count_bytes(void *user, uint8_t *buf, size_t len) {
+  (void)buf;
+  *(size_t *)user += len;
+}
+
+// A line of hundreds of runs is flushed a run at a time, it all reaches
+// emit and nothing is written past the encoder buffer
+static void check_long_line(void) {
+  static struct {
+    uint8_t buf[BENCH_BUF];
+    uint8_t guard[64];
+  } out;
+  static uint16_t runs[2*400];
+  static uint8_t clr[400];
+  encoder_t enc;
+  size_t total = 0;
+  for (int i = 0; i < 400; i++) {
+    runs[2*i] = XFX(2*i);
+    runs[2*i+1] = XFX(2*i+1);
+    clr[i] = 1 + i%7;
+  }
+  memset(out.guard, 0xa5, sizeof(out.guard));
+  init_encoder(&enc, out.buf, sizeof(out.buf), count_bytes, &total);
+  size_t expect = line_bytes(&enc, 10, runs, 400);
+  enc.base.line(&(enc.base), 10, runs, clr, 400);
+  total += enc.bufpos;
+  bool intact = true;
+  for (size_t i = 0; i < sizeof(out.guard); i++)
+    intact = intact && out.guard[i] == 0xa5;
+  check("long_line", intact && total == expect, "a 400 run line overran the buffer or lost bytes");
+}
+
+
+//////////////////////////////////////// Replay
+
+typedef struct replay_obj_s {
+  int type;
+  union {
+    rectangle_t rect;
+    rect_batch_t batch;
+    polygon_t poly;
+    instance_t inst;
+    trace_t trace;
+    layer_t layer;
+    path_t path;
+  } u;
+  polygon_t shared; // geometry of an instance
+  union {
+    rect_iter_t rect;
+    rect_batch_iter_t batch;
+    poly_iter_t poly;
+    outline_iter_t outline;
+    trace_iter_t trace;
+    layer_iter_t layer;
+  } iter;
+} replay_obj_t;
+
+typedef struct reader_s {
+  const uint8_t *p, *end;
+  bool bad;
+} reader_t;
+
+static uint8_t get8(reader_t *r) {
+  if (r->p >= r->end) {
+    r->bad = true;
+    return 0;
+  }
+  return *r->p++;
+}
+
+static uint16_t get16(reader_t *r) {
+  uint16_t v = get8(r)<<8;
+  return v | get8(r);
+}
+
+static uint16_t *get_values(reader_t *r, int n) {
+  uint16_t *v = (uint16_t *)calloc(n+1, sizeof(uint16_t));
+  for (int i = 0; i < n; i++)
+    v[i] = get16(r);
+  return v;
+}
+
+static uint8_t *get_bytes(reader_t *r, int n) {
+  uint8_t *v = (uint8_t *)calloc(n+1, 1);
+  for (int i = 0; i < n; i++)
+    v[i] = get8(r);
+  return v;
+}
+
+static void read_polygon(reader_t *r, polygon_t *poly) {
+  init_polygon(poly);
+  poly->tr.tx = get16(r);
+  poly->tr.ty = get16(r);
+  uint8_t flags = get8(r);
+  poly->fill = flags & 1;
+  poly->stroke = (flags>>1) & 1;
+  poly->rule = get8(r);
+  poly->fclr = get8(r);
+  poly->sclr = get8(r);
+  poly->width = get16(r);
+  poly->n_pts = get16(r);
+  poly->n_contours = get16(r);
+  poly->pts = get_values(r, poly->n_pts);
+  poly->max_pts = poly->n_pts;
+  if (poly->n_contours > 1) {
+    poly->ends = get_values(r, poly->n_contours);
+    poly->max_contours = poly->n_contours;
+  }
+  poly->n_dash = get16(r);
+  poly->dash = get_values(r, poly->n_dash);
+  poly->max_dash = poly->n_dash;
+}
+
+static bool read_object(reader_t *r, replay_obj_t *obj) {
+  obj->type = get8(r);
+  switch (obj->type) {
+  case CAPTURE_RECT: {
+    rectangle_t *rect = &(obj->u.rect);
+    init_transform(&(rect->tr));
+    rect->tr.tx = get16(r);
+    rect->tr.ty = get16(r);
+    uint8_t flags = get8(r);
+    rect->fill = flags & 1;
+    rect->stroke = (flags>>1) & 1;
+    rect->fclr = get8(r);
+    rect->sclr = get8(r);
+    rect->w = get16(r);
+    rect->h = get16(r);
+    break;
+  }
+  case CAPTURE_BATCH: {
+    rect_batch_t *batch = &(obj->u.batch);
+    init_transform(&(batch->tr));
+    batch->tr.tx = get16(r);
+    batch->tr.ty = get16(r);
+    batch->n = get16(r);
+    batch->x = get_values(r, batch->n);
+    batch->y = get_values(r, batch->n);
+    batch->w = get_values(r, batch->n);
+    batch->h = get_values(r, batch->n);
+    batch->clr = get_bytes(r, batch->n);
+    batch->order = (uint16_t *)calloc(batch->n+1, sizeof(uint16_t));
+    for (int i = 0; i < batch->n; i++)
+      batch->order[i] = i;
+    batch->sorted = false;
+    break;
+  }
+  case CAPTURE_POLYGON:
+    read_polygon(r, &(obj->u.poly));
+    break;
+  case CAPTURE_INSTANCE: {
+    instance_t *inst = &(obj->u.inst);
+    init_transform(&(inst->tr));
+    inst->tr.tx = get16(r);
+    inst->tr.ty = get16(r);
+    inst->recolor = get8(r);
+    inst->clr = get8(r);
+    if (get8(r) != CAPTURE_POLYGON)
+      return false;
+    read_polygon(r, &(obj->shared));
+    inst->poly = &(obj->shared);
+    break;
+  }
+  case CAPTURE_TRACE: {
+    trace_t *trace = &(obj->u.trace);
+    init_transform(&(trace->tr));
+    trace->tr.tx = get16(r);
+    trace->tr.ty = get16(r);
+    trace->dx = get16(r);
+    trace->width = get16(r);
+    trace->clr = get8(r);
+    trace->n_samples = get16(r);
+    trace->max_samples = trace->n_samples;
+    trace->samples = get_values(r, trace->n_samples);
+    trace->order = (uint16_t *)calloc(trace->n_samples+1, sizeof(uint16_t));
+    trace_changed(trace);
+    break;
+  }
+  case CAPTURE_LAYER: {
+    layer_t *layer = &(obj->u.layer);
+    init_layer(layer, get16(r));
+    // grown as lines are read, a layer line holds up to a run per pixel
+    uint32_t room = 0;
+    for (int y = 0; y < layer->height && !r->bad; y++) {
+      uint32_t k = layer->start[y];
+      uint16_t n = get16(r);
+      if (k+n+1 > room) {
+	room = 2*(k+n+1);
+	layer->runs = (uint16_t *)realloc(layer->runs, 2*room*sizeof(uint16_t));
+	layer->clr = (uint8_t *)realloc(layer->clr, room);
+      }
+      for (int i = 0; i < 2*n; i++)
+	layer->runs[2*k+i] = get16(r);
+      for (int i = 0; i < n; i++)
+	layer->clr[k+i] = get8(r);
+      layer->start[y+1] = k+n;
+    }
+    layer->n_runs = layer->start[layer->height];
+    break;
+  }
+  case CAPTURE_PATH: {
+    path_t *path = &(obj->u.path);
+    init_path(path);
+    path->tr.tx = get16(r);
+    path->tr.ty = get16(r);
+    path->rule = get8(r);
+    path->fclr = get8(r);
+    path->n_cmds = get16(r);
+    path->n_pts = get16(r);
+    path->cmds = get_bytes(r, path->n_cmds);
+    path->pts = get_values(r, path->n_pts);
+    path->max_cmds = path->n_cmds;
+    path->max_pts = path->n_pts;
+    break;
+  }
+  default:
+    return false;
+  }
+  return !r->bad;
+}
+
+static void free_object(replay_obj_t *obj) {
+  switch (obj->type) {
+  case CAPTURE_BATCH:
+    free(obj->u.batch.x);
+    free(obj->u.batch.y);
+    free(obj->u.batch.w);
+    free(obj->u.batch.h);
+    free(obj->u.batch.clr);
+    free(obj->u.batch.order);
+    break;
+  case CAPTURE_POLYGON:
+    free(obj->u.poly.dash);
+    free_polygon(&(obj->u.poly));
+    break;
+  case CAPTURE_INSTANCE:
+    free(obj->shared.dash);
+    free_polygon(&(obj->shared));
+    break;
+  case CAPTURE_TRACE:
+    free(obj->u.trace.samples);
+    free(obj->u.trace.order);
+    break;
+  case CAPTURE_LAYER:
+    free(obj->u.layer.start);
+    free(obj->u.layer.runs);
+    free(obj->u.layer.clr);
+    break;
+  case CAPTURE_PATH:
+    free(obj->u.path.cmds);
+    free(obj->u.path.pts);
+    free(obj->u.path.fill_tab.edges);
+    free(obj->u.path.fill_tab.bots);
+    break;
+  }
+}
+
+// Prepared objects the first time, later calls find them built
+static iter_base_t *replay_iter(replay_obj_t *obj) {
+  switch (obj->type) {
+  case CAPTURE_RECT:
+    init_rectangle_iter(&(obj->u.rect), &(obj->iter.rect));
+    break;
+  case CAPTURE_BATCH:
+    prepare_rect_batch(&(obj->u.batch));
+    init_rect_batch_iter(&(obj->u.batch), &(obj->iter.batch));
+    break;
+  case CAPTURE_POLYGON:
+    prepare_polygon(&(obj->u.poly));
+    if (obj->u.poly.fill && obj->u.poly.stroke)
+      init_outline_iter(&(obj->u.poly), &(obj->iter.outline));
+    else
+      init_polygon_iter(&(obj->u.poly), &(obj->iter.poly));
+    break;
+  case CAPTURE_INSTANCE:
+    prepare_instance(&(obj->u.inst));
+    if (obj->shared.fill && obj->shared.stroke)
+      init_instance_outline_iter(&(obj->u.inst), &(obj->iter.outline));
+    else
+      init_instance_iter(&(obj->u.inst), &(obj->iter.poly));
+    break;
+  case CAPTURE_TRACE:
+    prepare_trace(&(obj->u.trace));
+    init_trace_iter(&(obj->u.trace), &(obj->iter.trace));
+    break;
+  case CAPTURE_LAYER:
+    init_layer_iter(&(obj->u.layer), &(obj->iter.layer));
+    break;
+  case CAPTURE_PATH:
+    prepare_path(&(obj->u.path));
+    init_path_iter(&(obj->u.path), &(obj->iter.poly));
+    break;
+  }
+  return (iter_base_t *)&(obj->iter);
+}
+
+// Counts what reaches the encoder
+typedef struct stats_sink_s {
+  span_sink_t base;
+  encoder_t *enc;
+  int lines, runs;
+} stats_sink_t;
+
+static size_t replay_budget; // bytes per line, 0 for no limit
+static const char *scene_path; // scene file the replayed frame is written to
+static bool scene_pack; // PackBits compress the scene file
+
+// The replayed frame, counted and written to the scene file if one is open
+typedef struct frame_out_s {
+  size_t bytes;
+  FILE *f;
+  uint8_t pack[PACKBITS_MAX(BENCH_BUF)];
+} frame_out_t;
+
+static void frame_emit(void *user, uint8_t *buf, size_t len) {
+  frame_out_t *out = (frame_out_t *)user;
+  out->bytes += len;
+  if (out->f == NULL)
+    return;
+  if (scene_pack)
+    fwrite(out->pack, 1, packbits_encode(buf, len, out->pack), out->f);
+  else
+    fwrite(buf, 1, len, out->f);
+}
+
+static void stats_line(span_sink_t *sink, uint16_t y, uint16_t *runs, uint8_t *clr, int n) {
+  stats_sink_t *stats = (stats_sink_t *)sink;
+  stats->lines++;
+  stats->runs += n;
+  stats->enc->base.line(&(stats->enc->base), y, runs, clr, n);
+}
+
+// Times the frame, then counts it and writes it as a scene if asked
+static int replay_frame(const char *path, replay_obj_t *objs, iter_base_t **list, int n,
+			int w, int h, uint16_t *runs, uint8_t *clr) {
+  static uint8_t buf[BENCH_BUF];
+  const char *base = strrchr(path, '/');
+  base = (base != NULL) ? base+1 : path;
+  char name[48];
+
+  snprintf(name, sizeof(name), "replay/%s", base);
+  BENCH(name, 20, , {
+      scan_t scan;
+      encoder_t enc;
+      for (int i = 0; i < n; i++)
+	list[i] = replay_iter(&objs[i]);
+      init_scan(&scan, list, n, XFX(w), h, runs, clr, LINE_RUNS(XFX(w)));
+      init_encoder(&enc, buf, sizeof(buf), discard, NULL);
+      enc.budget = replay_budget;
+      while (scan_line(&scan, &(enc.base)))
+	;
+      end_scan(&scan);
+    });
+
+  scan_t scan;
+  encoder_t enc;
+  stats_sink_t stats = { { stats_line }, &enc, 0, 0 };
+  static frame_out_t out;
+  out.bytes = 0;
+  out.f = NULL;
+  if (scene_path != NULL) {
+    out.f = fopen(scene_path, "wb");
+    if (out.f == NULL) {
+      perror(scene_path);
+      return 2;
+    }
+    uint8_t hdr[SCENE_HEADER_SIZE];
+    scene_header(hdr, scene_pack ? SCENE_PACKBITS : 0, w, h);
+    fwrite(hdr, 1, SCENE_HEADER_SIZE, out.f);
+  }
+  for (int i = 0; i < n; i++)
+    list[i] = replay_iter(&objs[i]);
+  init_scan(&scan, list, n, XFX(w), h, runs, clr, LINE_RUNS(XFX(w)));
+  init_encoder(&enc, buf, sizeof(buf), frame_emit, &out);
+  enc.budget = replay_budget;
+  while (scan_line(&scan, &(stats.base)))
+    ;
+  end_scan(&scan);
+  buf[enc.bufpos++] = 0xff;
+  buf[enc.bufpos++] = 0xff;
+  frame_emit(&out, buf, enc.bufpos);
+  if (out.f != NULL)
+    fclose(out.f);
+  size_t replay_bytes = out.bytes;
+  snprintf(name, sizeof(name), "replay/%s/lines", base);
+  report_count(name, stats.lines);
+  snprintf(name, sizeof(name), "replay/%s/runs", base);
+  report_count(name, stats.runs);
+  snprintf(name, sizeof(name), "replay/%s/bytes", base);
+  report_count(name, replay_bytes);
+  if (replay_budget > 0) {
+    snprintf(name, sizeof(name), "replay/%s/degraded", base);
+    report_count(name, enc.degraded);
+  }
+  return 0;
+}
+
+static int bench_replay(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return 2;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = (uint8_t *)malloc(len > 0 ? len : 1);
+  if (fread(data, 1, len, f) != (size_t)len)
+    len = 0;
+  fclose(f);
+
+  reader_t r = { data, data+len, false };
+  if (len < 11 || memcmp(data, CAPTURE_MAGIC, 4) != 0 || data[4] != CAPTURE_VERSION) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    free(data);
+    return 2;
+  }
+  r.p += 5;
+  int w = get16(&r), h = get16(&r), n = get16(&r);
+  if (w == 0 || h == 0) {
+    w = 800;
+    h = 480;
+  }
+  if (replay_budget > 0 && replay_budget < min_line_budget(XFX(w))) {
+    fprintf(stderr, "%s: budget below %d bytes for width %d\n", path, (int)min_line_budget(XFX(w)), w);
+    free(data);
+    return 2;
+  }
+  if (min_line_budget(XFX(w)) + 2 > BENCH_BUF) {
+    fprintf(stderr, "%s: width %d too large for the encoder buffer\n", path, w);
+    free(data);
+    return 2;
+  }
+  replay_obj_t *objs = (replay_obj_t *)calloc(n+1, sizeof(replay_obj_t));
+  iter_base_t **list = (iter_base_t **)calloc(n+1, sizeof(iter_base_t *));
+  uint16_t *runs = (uint16_t *)calloc(2*SCAN_RUNS(LINE_RUNS(XFX(w))), sizeof(uint16_t));
+  uint8_t *clr = (uint8_t *)calloc(SCAN_RUNS(LINE_RUNS(XFX(w))), 1);
+  int status = 0;
+  for (int i = 0; i < n && status == 0; i++) {
+    if (!read_object(&r, &objs[i])) {
+      fprintf(stderr, "%s: bad object %d\n", path, i);
+      status = 2;
+    }
+  }
+  if (status == 0)
+    status = replay_frame(path, objs, list, n, w, h, runs, clr);
+  for (int i = 0; i < n; i++)
+    free_object(&objs[i]);
+  free(clr);
+  free(runs);
+  free(list);
+  free(objs);
+  free(data);
+  return status;
+}
+
+//////////////////////////////////////// Baseline
+
+static int save_baseline(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return 2;
+  }
+  for (int i = 0; i < n_results; i++) {
+    if (results[i].count)
+      fprintf(f, "%s count %ld\n", results[i].name, (long)results[i].value);
+    else
+      fprintf(f, "%s %.1f\n", results[i].name, results[i].value);
+  }
+  fclose(f);
+  return 0;
+}
+
+static int compare_baseline(const char *path, double threshold) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return 2;
+  }
+  char line[128], name[48];
+  double base;
+  long n;
+  int failed = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    bool count = sscanf(line, "%47s count %ld", name, &n) == 2;
+    if (count)
+      base = n;
+    else if (sscanf(line, "%47s %lf", name, &base) != 2)
+      continue;
+    for (int i = 0; i < n_results; i++) {
+      if (strcmp(results[i].name, name) != 0 || results[i].count != count)
+	continue;
+      if (count) {
+	if (results[i].value != base) {
+	  fprintf(stderr, "CHANGED %s %ld -> %ld\n", name, n, (long)results[i].value);
+	  failed = 1;
+	}
+      } else {
+	double pct = 100.0*(results[i].value-base)/base;
+	if (pct > threshold) {
+	  fprintf(stderr, "REGRESSION %s %.1f -> %.1f (+%.0f%%)\n", name, base, results[i].value, pct);
+	  failed = 1;
+	}
+      }
+    }
+  }
+  fclose(f);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  const char *save = NULL, *compare = NULL;
+  const char *replays[MAX_REPLAYS];
+  int n_replays = 0;
+  double threshold = 10;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i+1 < argc)
+      save = argv[++i];
+    else if (strcmp(argv[i], "-c") == 0 && i+1 < argc)
+      compare = argv[++i];
+    else if (strcmp(argv[i], "-t") == 0 && i+1 < argc)
+      threshold = atof(argv[++i]);
+    else if (strcmp(argv[i], "-b") == 0 && i+1 < argc)
+      replay_budget = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0 && i+1 < argc && n_replays < MAX_REPLAYS)
+      replays[n_replays++] = argv[++i];
+    else if (strcmp(argv[i], "-w") == 0 && i+1 < argc)
+      scene_path = argv[++i];
+    else if (strcmp(argv[i], "-z") == 0)
+      scene_pack = true;
+    else {
+      fprintf(stderr, "usage: %s [-s baseline] [-c baseline] [-t percent] [-b budget] [-r capture]... [-w scene [-z]]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  check_square();
+  check_outline();
+  check_dash();
+  check_long_line();
+  check_empty_contours();
+
+  bench_fill_edges();
+  bench_fill_sweep();
+  bench_stroke_sweep();
+  bench_path();
+  bench_sort_runs();
+  bench_encode();
+  bench_generator();
+  bench_outline();
+  bench_dash();
+  bench_simplify();
+  for (int i = 0; i < n_replays; i++) {
+    if (bench_replay(replays[i]) != 0)
+      return 2;
+  }
+
+  int status = (failed_checks > 0) ? 1 : 0;
+  if (save != NULL && save_baseline(save) != 0)
+    return 2;
+  if (compare != NULL && compare_baseline(compare, threshold) != 0)
+    status = 1;
+  return status;
+}